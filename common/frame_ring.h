@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FRAME_RING_H
+#define FLB_FRAME_RING_H
+
+/*
+ * Shared-memory frame ring: a memfd holding a fixed number of frame slots,
+ * so that frames can be handed from a producer (the camera plugin) to
+ * consumers (the TensorFlow filter) by reference instead of through the
+ * chunks. A consumer maps the ring through /proc/<pid>/fd/<fd>.
+ *
+ * Each slot is guarded by a sequence number: the producer clears it before
+ * it writes the slot, and sets it to the sequence number of the frame once
+ * the frame is complete. A consumer holding a reference (slot, seq) checks
+ * the sequence number before and after reading the slot, to detect that the
+ * slot has been reused in the meantime.
+ *
+ * Header only, shared by the C plugins and the C++ capture code.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+
+#define FRAME_RING_MAGIC 0x474e5246  /* "FRNG" */
+#define FRAME_RING_ALIGN 64
+
+/* at the start of the ring, followed by the slots */
+struct frame_ring_header {
+    uint32_t magic;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    uint64_t slot_stride;
+};
+
+struct frame_ring {
+    int fd;
+    char *base;
+    size_t size;
+    uint32_t slot_count;
+    size_t slot_size;
+    size_t slot_stride;
+    char path[64];
+};
+
+/*
+ * slot layout: the sequence number on its own cache line, followed by the
+ * (cache line aligned) frame data
+ */
+static inline uint64_t *frame_ring_seq(struct frame_ring *r, uint32_t slot)
+{
+    return (uint64_t *) (r->base + FRAME_RING_ALIGN + slot * r->slot_stride);
+}
+
+static inline char *frame_ring_data(struct frame_ring *r, uint32_t slot)
+{
+    return r->base + FRAME_RING_ALIGN + slot * r->slot_stride + FRAME_RING_ALIGN;
+}
+
+/* producer: create a ring of slot_count slots of slot_size bytes */
+static inline int frame_ring_create(struct frame_ring *r, const char *name,
+                                    uint32_t slot_count, size_t slot_size)
+{
+    struct frame_ring_header *hdr;
+
+    r->slot_count = slot_count;
+    r->slot_size = slot_size;
+    r->slot_stride = FRAME_RING_ALIGN +
+                     (slot_size + FRAME_RING_ALIGN - 1) / FRAME_RING_ALIGN * FRAME_RING_ALIGN;
+    r->size = FRAME_RING_ALIGN + slot_count * r->slot_stride;
+
+    /* memfd_create(2) through syscall(2): older C libraries don't wrap it */
+    r->fd = syscall(SYS_memfd_create, name, MFD_CLOEXEC);
+    if (r->fd == -1) {
+        return -1;
+    }
+
+    if (ftruncate(r->fd, r->size) == -1) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->base = (char *) mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->base == MAP_FAILED) {
+        r->base = NULL;
+        close(r->fd);
+        return -1;
+    }
+
+    /* the file is zero filled: no slot holds a frame yet */
+    hdr = (struct frame_ring_header *) r->base;
+    hdr->magic = FRAME_RING_MAGIC;
+    hdr->slot_count = slot_count;
+    hdr->slot_size = slot_size;
+    hdr->slot_stride = r->slot_stride;
+
+    snprintf(r->path, sizeof(r->path), "/proc/%d/fd/%d", (int) getpid(), r->fd);
+
+    return 0;
+}
+
+/* consumer: map the ring of a producer, read only */
+static inline int frame_ring_open(struct frame_ring *r, const char *path)
+{
+    struct stat st;
+    struct frame_ring_header *hdr;
+
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd == -1) {
+        return -1;
+    }
+
+    if (fstat(r->fd, &st) == -1 || (size_t) st.st_size < sizeof(struct frame_ring_header)) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->size = st.st_size;
+    r->base = (char *) mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (r->base == MAP_FAILED) {
+        r->base = NULL;
+        close(r->fd);
+        return -1;
+    }
+
+    hdr = (struct frame_ring_header *) r->base;
+    if (hdr->magic != FRAME_RING_MAGIC ||
+        FRAME_RING_ALIGN + hdr->slot_count * hdr->slot_stride > r->size) {
+        munmap(r->base, r->size);
+        r->base = NULL;
+        close(r->fd);
+        return -1;
+    }
+
+    r->slot_count = hdr->slot_count;
+    r->slot_size = hdr->slot_size;
+    r->slot_stride = hdr->slot_stride;
+    snprintf(r->path, sizeof(r->path), "%s", path);
+
+    return 0;
+}
+
+/* the ring is only valid if base is set */
+static inline void frame_ring_destroy(struct frame_ring *r)
+{
+    if (!r->base || r->base == MAP_FAILED) {
+        return;
+    }
+
+    munmap(r->base, r->size);
+    close(r->fd);
+    r->base = NULL;
+}
+
+/* producer: invalidate the slot before writing a new frame into it */
+static inline void frame_ring_begin_write(struct frame_ring *r, uint32_t slot)
+{
+    __atomic_store_n(frame_ring_seq(r, slot), 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* producer: the frame in the slot is complete (seq > 0) */
+static inline void frame_ring_end_write(struct frame_ring *r, uint32_t slot, uint64_t seq)
+{
+    __atomic_store_n(frame_ring_seq(r, slot), seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * consumer: check that the slot still holds frame seq. Called before reading
+ * the slot, and again after it, to detect a concurrent overwrite.
+ */
+static inline int frame_ring_valid(struct frame_ring *r, uint32_t slot, uint64_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(frame_ring_seq(r, slot), __ATOMIC_ACQUIRE) == seq;
+}
+
+#endif
@@ -0,0 +1,239 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_THREAD_PLACEMENT_H
+#define FLB_THREAD_PLACEMENT_H
+
+/*
+ * Thread placement: the CPUs a thread may run on, and its scheduling policy
+ * and priority, so that latency-critical threads (frame capture, inference)
+ * can be kept apart from the engine and the flush path.
+ *
+ * Real-time policies require CAP_SYS_NICE or an RLIMIT_RTPRIO allowing the
+ * priority. The affinity and the policy are applied independently: if one
+ * of them fails, the thread keeps its previous setting for it and the error
+ * is returned to the caller, which decides how loud to be about it.
+ *
+ * Header only. The including file has to define _GNU_SOURCE before any
+ * system header (cpu_set_t, pthread_setaffinity_np).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct thread_placement {
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_sched;
+    int policy;
+    int priority;
+};
+
+static inline const char *thread_policy_name(int policy)
+{
+    switch (policy) {
+    case SCHED_FIFO:
+        return "fifo";
+    case SCHED_RR:
+        return "rr";
+    case SCHED_OTHER:
+        return "other";
+    default:
+        return "unknown";
+    }
+}
+
+/* parse a list of CPUs and CPU ranges, e.g. "2-3,6" */
+static inline int thread_cpus_parse(const char *str, cpu_set_t *set)
+{
+    long first;
+    long last;
+    long cpu;
+    char *end;
+
+    CPU_ZERO(set);
+
+    while (*str) {
+        first = strtol(str, &end, 10);
+        if (end == str || first < 0) {
+            return -1;
+        }
+        last = first;
+
+        if (*end == '-') {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first) {
+                return -1;
+            }
+        }
+
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        if (*end == ',') {
+            end++;
+        }
+        else if (*end != '\0') {
+            return -1;
+        }
+        str = end;
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/*
+ * set a placement from plugin options: cpus and policy (other | fifo | rr)
+ * are optional. Returns NULL on success, or what is wrong with the options.
+ */
+static inline const char *thread_placement_parse(struct thread_placement *p,
+                                                 const char *cpus,
+                                                 const char *policy,
+                                                 int priority)
+{
+    memset(p, 0, sizeof(struct thread_placement));
+    p->policy = SCHED_OTHER;
+
+    if (cpus) {
+        if (thread_cpus_parse(cpus, &p->cpus) == -1) {
+            return "invalid CPU list (e.g. \"2-3,6\")";
+        }
+        p->has_cpus = 1;
+    }
+
+    if (!policy) {
+        return NULL;
+    }
+
+    if (strcasecmp(policy, "fifo") == 0) {
+        p->policy = SCHED_FIFO;
+    }
+    else if (strcasecmp(policy, "rr") == 0) {
+        p->policy = SCHED_RR;
+    }
+    else if (strcasecmp(policy, "other") != 0) {
+        return "scheduling policy must be \"other\", \"fifo\" or \"rr\"";
+    }
+
+    if (priority < sched_get_priority_min(p->policy) ||
+        priority > sched_get_priority_max(p->policy)) {
+        return "scheduling priority out of the range of the policy "
+               "(1-99 for fifo and rr, 0 for other)";
+    }
+
+    p->has_sched = 1;
+    p->priority = priority;
+
+    return NULL;
+}
+
+/* the current placement of a thread, e.g. to restore it later */
+static inline int thread_placement_get(pthread_t thread, struct thread_placement *p)
+{
+    struct sched_param param;
+
+    memset(p, 0, sizeof(struct thread_placement));
+
+    if (pthread_getaffinity_np(thread, sizeof(cpu_set_t), &p->cpus) != 0 ||
+        pthread_getschedparam(thread, &p->policy, &param) != 0) {
+        return -1;
+    }
+
+    p->has_cpus = 1;
+    p->has_sched = 1;
+    p->priority = param.sched_priority;
+
+    return 0;
+}
+
+/* apply a placement: err_cpus and err_sched are set to the errors, if any */
+static inline void thread_placement_apply(pthread_t thread, struct thread_placement *p,
+                                          int *err_cpus, int *err_sched)
+{
+    struct sched_param param;
+
+    *err_cpus = 0;
+    *err_sched = 0;
+
+    if (p->has_cpus) {
+        *err_cpus = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &p->cpus);
+    }
+
+    if (p->has_sched) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = p->priority;
+        *err_sched = pthread_setschedparam(thread, p->policy, &param);
+    }
+}
+
+/* describe the effective placement of a thread, e.g. "policy fifo/50, cpus 2-3,6" */
+static inline void thread_placement_describe(pthread_t thread, char *buf, size_t size)
+{
+    int cpu;
+    int first = -1;
+    size_t len;
+    struct thread_placement p;
+
+    if (thread_placement_get(thread, &p) == -1) {
+        snprintf(buf, size, "unknown");
+        return;
+    }
+
+    len = snprintf(buf, size, "policy %s/%d, cpus ",
+                   thread_policy_name(p.policy), p.priority);
+
+    /* ranges of consecutive CPUs */
+    for (cpu = 0; cpu <= CPU_SETSIZE && len < size; cpu++) {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &p.cpus)) {
+            if (first == -1) {
+                first = cpu;
+            }
+            continue;
+        }
+
+        if (first == -1) {
+            continue;
+        }
+
+        if (cpu - 1 > first) {
+            len += snprintf(buf + len, size - len, "%d-%d,", first, cpu - 1);
+        }
+        else {
+            len += snprintf(buf + len, size - len, "%d,", first);
+        }
+        first = -1;
+    }
+
+    /* trailing comma */
+    if (len > 0 && len <= size && buf[len - 1] == ',') {
+        buf[len - 1] = '\0';
+    }
+}
+
+#endif
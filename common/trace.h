@@ -0,0 +1,274 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_TRACE_H
+#define FLB_TRACE_H
+
+/*
+ * Span tracing for offline profiling: spans (a name, a start and an end on
+ * the monotonic clock, and the sequence number of the frame they belong to)
+ * are written into a per-thread ring buffer, and dumped periodically to a
+ * file in the Chrome trace event format, to be loaded in chrome://tracing or
+ * Perfetto.
+ *
+ * Each ring has a single producer (its thread) and a single consumer (the
+ * thread flushing the trace), so spans are recorded without locks. Spans are
+ * dropped (and counted) if the ring is full. The file is a JSON array that is
+ * never closed, which the trace viewers accept: it can be loaded while the
+ * trace is still being written. The files of several plugin instances of a
+ * process can be merged into one trace (the clock is the same): the opening
+ * "[" line has to be dropped from all of them but the first.
+ *
+ * Span names have to be string literals. Header only, shared by the C
+ * plugins and the C++ capture code.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_THREADS 8
+#define TRACE_EVENTS  4096  /* per thread, power of 2 */
+
+struct trace_event {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t seq;
+};
+
+struct trace_thread {
+    pid_t tid;
+    char name[48];
+    int named;                 /* thread name written into the trace */
+    uint64_t head;             /* written by the producer */
+    uint64_t tail;             /* written by the consumer */
+    uint64_t dropped;
+    struct trace_event events[TRACE_EVENTS];
+};
+
+struct trace {
+    FILE *file;
+    char prefix[32];
+    pid_t pid;
+    uint64_t flush_ns;
+    uint64_t last_flush_ns;
+    int flushing;
+    int thread_count;
+    struct trace_thread *threads[TRACE_THREADS];
+};
+
+static inline uint64_t trace_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * open the trace file (overwritten). Thread names are prefixed with prefix,
+ * e.g. the name of the plugin instance.
+ */
+static inline struct trace *trace_create(const char *path, const char *prefix, int flush_ms)
+{
+    struct trace *t;
+
+    t = (struct trace *) calloc(1, sizeof(struct trace));
+    if (!t) {
+        return NULL;
+    }
+
+    t->file = fopen(path, "w");
+    if (!t->file) {
+        free(t);
+        return NULL;
+    }
+
+    snprintf(t->prefix, sizeof(t->prefix), "%s", prefix);
+    t->pid = getpid();
+    t->flush_ns = (uint64_t) flush_ms * 1000000;
+    t->last_flush_ns = trace_now();
+
+    fputs("[\n", t->file);
+
+    return t;
+}
+
+/*
+ * the ring of the calling thread, registered on its first span. Returns
+ * NULL if all the rings are taken: the spans of that thread are then
+ * ignored, without trying to register it again.
+ */
+static inline struct trace_thread *trace_thread_get(struct trace *t, const char *name)
+{
+    int i;
+    int n;
+    pid_t tid = syscall(SYS_gettid);
+    struct trace_thread *th;
+
+    n = __atomic_load_n(&t->thread_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n && i < TRACE_THREADS; i++) {
+        th = __atomic_load_n(&t->threads[i], __ATOMIC_ACQUIRE);
+        if (th && th->tid == tid) {
+            return th;
+        }
+    }
+
+    if (n >= TRACE_THREADS) {
+        return NULL;
+    }
+
+    th = (struct trace_thread *) calloc(1, sizeof(struct trace_thread));
+    if (!th) {
+        return NULL;
+    }
+    th->tid = tid;
+    snprintf(th->name, sizeof(th->name), "%s %s", t->prefix, name);
+
+    /* claim a slot (thread_count never exceeds TRACE_THREADS), then publish the ring in it */
+    do {
+        if (n >= TRACE_THREADS) {
+            free(th);
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&t->thread_count, &n, n + 1, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    __atomic_store_n(&t->threads[n], th, __ATOMIC_RELEASE);
+
+    return th;
+}
+
+/* record a span of the calling thread, from start_ns until now */
+static inline void trace_span(struct trace *t, const char *thread_name,
+                              const char *name, uint64_t start_ns, uint64_t seq)
+{
+    uint64_t head;
+    struct trace_thread *th;
+    struct trace_event *e;
+
+    th = trace_thread_get(t, thread_name);
+    if (!th) {
+        return;
+    }
+
+    head = th->head;
+    if (head - __atomic_load_n(&th->tail, __ATOMIC_ACQUIRE) == TRACE_EVENTS) {
+        __atomic_fetch_add(&th->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    e = &th->events[head & (TRACE_EVENTS - 1)];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->end_ns = trace_now();
+    e->seq = seq;
+
+    __atomic_store_n(&th->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * write the spans recorded since the last flush, if the flush interval has
+ * elapsed (or force is set). Only one thread flushes at a time, the others
+ * return right away.
+ */
+static inline void trace_flush(struct trace *t, int force)
+{
+    int i;
+    int n;
+    uint64_t now;
+    uint64_t head;
+    uint64_t tail;
+    struct trace_thread *th;
+    struct trace_event *e;
+
+    now = trace_now();
+    if (!force && now - __atomic_load_n(&t->last_flush_ns, __ATOMIC_RELAXED) < t->flush_ns) {
+        return;
+    }
+
+    if (__atomic_exchange_n(&t->flushing, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&t->last_flush_ns, now, __ATOMIC_RELAXED);
+
+    n = __atomic_load_n(&t->thread_count, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n && i < TRACE_THREADS; i++) {
+        th = __atomic_load_n(&t->threads[i], __ATOMIC_ACQUIRE);
+        if (!th) {
+            continue;
+        }
+
+        if (!th->named) {
+            fprintf(t->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}},\n", t->pid, th->tid, th->name);
+            th->named = 1;
+        }
+
+        head = __atomic_load_n(&th->head, __ATOMIC_ACQUIRE);
+        for (tail = th->tail; tail != head; tail++) {
+            e = &th->events[tail & (TRACE_EVENTS - 1)];
+            fprintf(t->file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"seq\":%llu}},\n",
+                    e->name, t->pid, th->tid, e->start_ns / 1000.0,
+                    (e->end_ns - e->start_ns) / 1000.0, (unsigned long long) e->seq);
+        }
+        __atomic_store_n(&th->tail, head, __ATOMIC_RELEASE);
+    }
+
+    fflush(t->file);
+    __atomic_store_n(&t->flushing, 0, __ATOMIC_RELEASE);
+}
+
+/* spans dropped on full rings, over all the threads */
+static inline uint64_t trace_dropped(struct trace *t)
+{
+    int i;
+    uint64_t dropped = 0;
+    struct trace_thread *th;
+
+    for (i = 0; i < __atomic_load_n(&t->thread_count, __ATOMIC_ACQUIRE) && i < TRACE_THREADS; i++) {
+        th = __atomic_load_n(&t->threads[i], __ATOMIC_ACQUIRE);
+        if (th) {
+            dropped += __atomic_load_n(&th->dropped, __ATOMIC_RELAXED);
+        }
+    }
+
+    return dropped;
+}
+
+/* flush the remaining spans and close the file. No span may be recorded anymore. */
+static inline void trace_destroy(struct trace *t)
+{
+    int i;
+
+    trace_flush(t, 1);
+    fclose(t->file);
+
+    for (i = 0; i < t->thread_count && i < TRACE_THREADS; i++) {
+        free(t->threads[i]);
+    }
+    free(t);
+}
+
+#endif
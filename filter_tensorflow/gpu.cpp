@@ -11,6 +11,8 @@
 #include "tensorflow/lite/interpreter.h"
 
 EXTERNC TfLiteStatus TfLiteInterpreterModifyGraphWithDelegate(const TfLiteInterpreter* interpreter, TfLiteDelegate* delegate);
+EXTERNC void TfLiteInterpreterSetCancellationFunction(const TfLiteInterpreter* interpreter, void* data,
+                                                      bool (*check_cancelled_func)(void*));
 
 #undef EXTERNC
 
@@ -21,3 +23,9 @@ TfLiteStatus TfLiteInterpreterModifyGraphWithDelegate(
     const TfLiteInterpreter* interpreter, TfLiteDelegate* delegate) {
     return interpreter->impl->ModifyGraphWithDelegate(delegate);
 }
+
+/* the check function is called between the ops of Invoke(), which fails once it returns true */
+void TfLiteInterpreterSetCancellationFunction(
+    const TfLiteInterpreter* interpreter, void* data, bool (*check_cancelled_func)(void*)) {
+    interpreter->impl->SetCancellationFunction(data, check_cancelled_func);
+}
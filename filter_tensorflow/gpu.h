@@ -7,5 +7,7 @@
 
 EXTERNC void print_me();
 EXTERNC TfLiteStatus TfLiteInterpreterModifyGraphWithDelegate(const TfLiteInterpreter* interpreter, TfLiteDelegate* delegate);
+EXTERNC void TfLiteInterpreterSetCancellationFunction(const TfLiteInterpreter* interpreter, void* data,
+                                                      bool (*check_cancelled_func)(void*));
 
 #undef EXTERNC
@@ -28,31 +28,38 @@ def rest_api(port):
         return jsonify({'name': 'FluentBit',
                         'email': 'FluentBit@fluentbit'})
 
+    # loaded once, not for every request
+    with open(os.path.join(dir, "imagenet_class_index.json"), 'r') as fp:
+        # potential mismatch. Element 0 in the JSON file doesn't match background (element 0 of the predictions)
+        imagenet_json = json.load(fp)
+
     @app.route('/', methods=['POST'])
     def show_image():
         global image
         global new_image
 
-        image = msgpack.unpackb(request.data)[1]['frame']
+        # the body is unpacked once, and may hold several records: the last one is displayed
+        unpacker = msgpack.Unpacker(raw=False)
+        unpacker.feed(request.data)
+
+        for _, record in unpacker:
+            image = record['frame']
 
-        preds = msgpack.unpackb(request.data)[1]['output']
-        # preds could be of two formats: plain or ordered.
-        #   plain is an array of values representing all the output tensors' values
-        #   ordered is a map of the format { '1': {'idx': <INDEX>, 'value': <VALUE>}, ...}
-        print(json.dumps(preds, indent=4))
+            preds = record['output']
+            # preds could be of two formats: plain or ordered.
+            #   plain is an array of values representing all the output tensors' values
+            #   ordered is a map of the format { '1': {'idx': <INDEX>, 'value': <VALUE>}, ...}
+            print(json.dumps(preds, indent=4))
 
-        with open(os.path.join(dir, "imagenet_class_index.json"), 'r') as fp:
-            # potential mismatch. Element 0 in the JSON file doesn't match background (element 0 of the predictions)
-            imagenet_json = json.load(fp)
+            # TODO: check the type of the output to detect the format
+            for order in preds:
+                if preds[order]['idx'] == 0:
+                    print('background', end=" ")
+                else:
+                    print(imagenet_json[str(preds[order]['idx'] - 1)], end=" ")
 
-        # TODO: check the type of the output to detect the format
-        for order in preds:
-            if preds[order]['idx'] == 0:
-                print('background', end=" ")
-            else:
-                print(imagenet_json[str(preds[order]['idx'] - 1)], end=" ")
+            print()
 
-        print()
         new_image = True
         return jsonify({})
 
@@ -0,0 +1,103 @@
+#!/usr/bin/python3
+# encoding: utf-8
+
+import argparse
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+import msgpack
+
+# an HTTP endpoint for the http output (format msgpack), like http_server.py,
+# measuring the records sent by load_generator.py: end-to-end latency
+# percentiles, loss and throughput
+
+lock = threading.Lock()
+latencies = []
+seqs = set()
+skipped = {}
+first_time = None
+last_time = None
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(p / 100 * len(values)))]
+
+
+def report(expected):
+    with lock:
+        if not latencies:
+            print('no records received')
+            return
+
+        values = sorted(latencies)
+        received = len(seqs)
+        # records are numbered from 0: unless told otherwise, the highest one
+        # received is the last one sent
+        total = expected or max(seqs) + 1
+        elapsed = last_time - first_time
+
+        print('received %d records (%.2f%% lost), %.1f records/s' %
+              (received, 100.0 * (total - received) / total,
+               received / elapsed if elapsed > 0 else 0))
+        print('latency (ms): p50 %.1f p90 %.1f p99 %.1f max %.1f' %
+              tuple(v * 1000 for v in (percentile(values, 50), percentile(values, 90),
+                                       percentile(values, 99), values[-1])))
+        if skipped:
+            print('skipped: ' + ', '.join('%s %d' % kv for kv in sorted(skipped.items())))
+
+
+class Handler(BaseHTTPRequestHandler):
+    def do_POST(self):
+        global first_time
+        global last_time
+
+        body = self.rfile.read(int(self.headers['Content-Length']))
+        now = time.time()
+
+        # the body is a chunk: any number of [timestamp, record] pairs
+        unpacker = msgpack.Unpacker(raw=False)
+        unpacker.feed(body)
+
+        with lock:
+            for _, record in unpacker:
+                if 'sent' not in record or 'seq' not in record:
+                    continue
+
+                latencies.append(now - record['sent'])
+                seqs.add(record['seq'])
+                if 'skipped' in record:
+                    skipped[record['skipped']] = skipped.get(record['skipped'], 0) + 1
+
+            first_time = first_time or now
+            last_time = now
+
+        self.send_response(200)
+        self.end_headers()
+
+    def log_message(self, format, *args):
+        pass
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('-p', '--port', type=int, default=5000, help='The port API server is listening on.')
+    parser.add_argument('--interval', type=float, default=10, help='Report interval (seconds).')
+    parser.add_argument('--expected', type=int, default=0,
+                        help='Number of records sent, for the loss (default: highest seq + 1).')
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer(('0.0.0.0', args.port), Handler)
+    t1 = threading.Thread(target=server.serve_forever)
+    # this is required for the keyboard interrupt to work
+    t1.daemon = True
+    t1.start()
+
+    try:
+        while True:
+            time.sleep(args.interval)
+            report(args.expected)
+
+    except KeyboardInterrupt:
+        server.shutdown()
+        report(args.expected)
@@ -0,0 +1,147 @@
+#!/usr/bin/python3
+# encoding: utf-8
+
+import argparse
+import gzip
+import json
+import os
+import socket
+import struct
+import threading
+import time
+
+import msgpack
+
+# a load generator publishing frames into the local Fluent Bit inputs, at a
+# fixed rate and over concurrent connections. Every record carries its
+# sequence number and send time, from which latency_sink.py computes the
+# end-to-end latency, loss and throughput of the pipeline.
+
+def load_frames(args):
+    width, height, channels = [int(v) for v in args.shape.split('x')]
+
+    if not args.pics:
+        # a handful of random frames, cycled through
+        return [os.urandom(width * height * channels) for _ in range(8)]
+
+    import cv2
+
+    frames = []
+    for name in sorted(os.listdir(args.pics)):
+        image = cv2.imread(os.path.join(args.pics, name))
+        if image is not None:
+            frames.append(cv2.resize(image, (width, height)).tobytes())
+
+    return frames
+
+
+def event_time(t):
+    # Fluent Bit EventTime: seconds and nanoseconds
+    return msgpack.ExtType(0, struct.pack('>II', int(t), int(t % 1 * 1e9)))
+
+
+class ForwardPublisher:
+    # PackedForward (or CompressedPackedForward) messages to in_forward:
+    # frames are sent as msgpack binaries
+    def __init__(self, args):
+        self.tag = args.tag
+        self.compress = args.compress
+        self.sock = socket.create_connection((args.host, args.port or 24224))
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def publish(self, records):
+        now = time.time()
+        entries = b''.join(msgpack.packb([event_time(now), r], use_bin_type=True)
+                           for r in records)
+        option = {'size': len(records)}
+        if self.compress:
+            entries = gzip.compress(entries, compresslevel=1)
+            option['compressed'] = 'gzip'
+        self.sock.sendall(msgpack.packb([self.tag, entries, option], use_bin_type=True))
+
+    def close(self):
+        self.sock.close()
+
+
+class MqttPublisher:
+    # in_mqtt only accepts JSON payloads: frames are sent as arrays of integers
+    def __init__(self, args):
+        import paho.mqtt.client as mqttClient
+
+        self.topic = 'fluentbit/' + args.tag
+        self.client = mqttClient.Client('flb_load_%d_%d' % (os.getpid(), threading.get_ident()))
+        self.client.connect(args.host, port=args.port or 1883)
+        self.client.loop_start()
+
+    def publish(self, records):
+        for r in records:
+            r = dict(r, frame=list(r['frame']))
+            self.client.publish(self.topic, json.dumps(r), qos=0)
+
+    def close(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+def worker(args, index, frames, stats):
+    publisher = ForwardPublisher(args) if args.input == 'forward' else MqttPublisher(args)
+
+    # each worker publishes rate / concurrency frames per second, in batches.
+    # All of them publish the same number of batches, so that the sequence
+    # numbers sent are contiguous.
+    interval = args.batch * args.concurrency / args.rate
+    total = args.count or int(args.duration * args.rate)
+    batches = total // (args.batch * args.concurrency)
+    next_time = time.monotonic()
+    seq = index
+    sent = 0
+
+    for _ in range(batches):
+        records = []
+        for _ in range(args.batch):
+            records.append({'frame': frames[seq % len(frames)], 'seq': seq, 'sent': time.time()})
+            seq += args.concurrency
+
+        publisher.publish(records)
+        sent += len(records)
+
+        next_time += interval
+        delay = next_time - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+    publisher.close()
+    stats[index] = sent
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--input', choices=['forward', 'mqtt'], default='forward',
+                        help='Fluent Bit input receiving the frames.')
+    parser.add_argument('--host', default='127.0.0.1', help='Address of the Fluent Bit input.')
+    parser.add_argument('--port', type=int, default=0, help='Port of the input (default: 24224 or 1883).')
+    parser.add_argument('--tag', default='flb_tensorflow', help='Tag (forward) or topic suffix (mqtt).')
+    parser.add_argument('--rate', type=float, default=30, help='Frames per second, all connections.')
+    parser.add_argument('--concurrency', type=int, default=1, help='Number of connections.')
+    parser.add_argument('--batch', type=int, default=1, help='Frames per forward message.')
+    parser.add_argument('--compress', action='store_true', help='gzip compress the forward messages.')
+    parser.add_argument('--duration', type=float, default=60, help='Test duration (seconds).')
+    parser.add_argument('--count', type=int, default=0, help='Frames to send (default: duration x rate).')
+    parser.add_argument('--shape', default='224x224x3', help='Frame width x height x channels.')
+    parser.add_argument('--pics', default=None,
+                        help='Directory of images to send (default: random frames).')
+    args = parser.parse_args()
+
+    frames = load_frames(args)
+    stats = [0] * args.concurrency
+    threads = [threading.Thread(target=worker, args=(args, i, frames, stats))
+               for i in range(args.concurrency)]
+
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+
+    print('sent %d frames in %.1f s (%.1f frames/s)' % (sum(stats), elapsed, sum(stats) / elapsed))
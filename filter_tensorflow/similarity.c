@@ -0,0 +1,422 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2019-2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <fluent-bit/flb_filter_plugin.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+#include "similarity.h"
+
+/* rows are padded to 16 floats (64 bytes, a cache line) */
+#define ROW_ALIGNMENT 64
+#define ROW_FLOATS (ROW_ALIGNMENT / sizeof(float))
+
+/* Lloyd iterations when building the IVF partitions */
+#define IVF_KMEANS_ITERATIONS 10
+
+/*
+ * dot product of two aligned rows; n is a multiple of ROW_FLOATS so there
+ * is no tail to handle
+ */
+static inline float dot_product(const float *a, const float *b, int n)
+{
+    int i;
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+
+    for (i = 0; i < n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+
+    return vgetq_lane_f32(acc0, 0) + vgetq_lane_f32(acc0, 1) +
+           vgetq_lane_f32(acc0, 2) + vgetq_lane_f32(acc0, 3);
+#elif defined(__SSE__)
+    float sum[4];
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+
+    for (i = 0; i < n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_load_ps(a + i), _mm_load_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_load_ps(a + i + 4), _mm_load_ps(b + i + 4)));
+    }
+    _mm_storeu_ps(sum, _mm_add_ps(acc0, acc1));
+
+    return sum[0] + sum[1] + sum[2] + sum[3];
+#else
+    float sum[4] = {0, 0, 0, 0};
+
+    for (i = 0; i < n; i += 4) {
+        sum[0] += a[i] * b[i];
+        sum[1] += a[i + 1] * b[i + 1];
+        sum[2] += a[i + 2] * b[i + 2];
+        sum[3] += a[i + 3] * b[i + 3];
+    }
+
+    return sum[0] + sum[1] + sum[2] + sum[3];
+#endif
+}
+
+static void normalize(float *v, int n)
+{
+    int i;
+    float norm;
+
+    norm = sqrtf(dot_product(v, v, n));
+    if (norm == 0) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        v[i] /= norm;
+    }
+}
+
+/* zeroed matrix of aligned rows, released with free() */
+static float *rows_create(int count, int row_size)
+{
+    void *rows;
+    size_t size;
+
+    size = (size_t) count * row_size * sizeof(float);
+    if (posix_memalign(&rows, ROW_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    memset(rows, 0, size);
+
+    return rows;
+}
+
+/* insert a score into a descending list of at most k scores */
+static void top_k_insert(int *ids, float *scores, int *n, int k, int id, float score)
+{
+    int i;
+
+    if (*n == k && score <= scores[k - 1]) {
+        return;
+    }
+
+    i = (*n < k) ? (*n)++ : k - 1;
+    for (; i > 0 && scores[i - 1] < score; i--) {
+        ids[i] = ids[i - 1];
+        scores[i] = scores[i - 1];
+    }
+    ids[i] = id;
+    scores[i] = score;
+}
+
+static void scan_rows(struct flb_tf_similarity *s, int from, int to, int *n)
+{
+    int r;
+    float score;
+
+    for (r = from; r < to; r++) {
+        score = dot_product(s->query, s->vectors + (size_t) r * s->row_size, s->row_size);
+        top_k_insert(s->top_ids, s->top_scores, n, s->top_k, s->ids[r], score);
+    }
+}
+
+static int nearest_centroid(struct flb_tf_similarity *s, const float *v)
+{
+    int l;
+    int best;
+    float score;
+    float best_score;
+
+    best = 0;
+    best_score = dot_product(v, s->centroids, s->row_size);
+    for (l = 1; l < s->nlist; l++) {
+        score = dot_product(v, s->centroids + (size_t) l * s->row_size, s->row_size);
+        if (score > best_score) {
+            best = l;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * partition the references with spherical k-means, and group the rows of
+ * each partition together so a probe scans contiguous memory
+ */
+static int build_ivf(struct flb_tf_similarity *s)
+{
+    int i;
+    int l;
+    int k;
+    int iter;
+    int *assign;
+    int *cursor;
+    float *v;
+    float *c;
+    float *grouped;
+    int *grouped_ids;
+
+    s->centroids = rows_create(s->nlist, s->row_size);
+    s->list_offsets = flb_calloc(s->nlist + 1, sizeof(int));
+    assign = flb_malloc(s->count * sizeof(int));
+    cursor = flb_malloc(s->nlist * sizeof(int));
+    if (!s->centroids || !s->list_offsets || !assign || !cursor) {
+        flb_free(assign);
+        flb_free(cursor);
+        return -1;
+    }
+
+    /* evenly spaced references as initial centroids */
+    for (l = 0; l < s->nlist; l++) {
+        v = s->vectors + (size_t) (l * (s->count / s->nlist)) * s->row_size;
+        memcpy(s->centroids + (size_t) l * s->row_size, v, s->row_size * sizeof(float));
+        normalize(s->centroids + (size_t) l * s->row_size, s->row_size);
+    }
+
+    for (iter = 0; ; iter++) {
+        for (i = 0; i < s->count; i++) {
+            assign[i] = nearest_centroid(s, s->vectors + (size_t) i * s->row_size);
+        }
+
+        if (iter == IVF_KMEANS_ITERATIONS) {
+            break;
+        }
+
+        memset(s->centroids, 0, (size_t) s->nlist * s->row_size * sizeof(float));
+        memset(cursor, 0, s->nlist * sizeof(int));
+        for (i = 0; i < s->count; i++) {
+            v = s->vectors + (size_t) i * s->row_size;
+            c = s->centroids + (size_t) assign[i] * s->row_size;
+            for (k = 0; k < s->dim; k++) {
+                c[k] += v[k];
+            }
+            cursor[assign[i]]++;
+        }
+
+        for (l = 0; l < s->nlist; l++) {
+            c = s->centroids + (size_t) l * s->row_size;
+            /* re-seed empty partitions */
+            if (cursor[l] == 0) {
+                memcpy(c, s->vectors + (size_t) (l * (s->count / s->nlist)) * s->row_size,
+                       s->row_size * sizeof(float));
+            }
+            normalize(c, s->row_size);
+        }
+    }
+
+    /* group the rows by partition */
+    for (i = 0; i < s->count; i++) {
+        s->list_offsets[assign[i] + 1]++;
+    }
+    for (l = 0; l < s->nlist; l++) {
+        s->list_offsets[l + 1] += s->list_offsets[l];
+        cursor[l] = s->list_offsets[l];
+    }
+
+    grouped = rows_create(s->count, s->row_size);
+    grouped_ids = flb_malloc(s->count * sizeof(int));
+    if (!grouped || !grouped_ids) {
+        free(grouped);
+        flb_free(grouped_ids);
+        flb_free(assign);
+        flb_free(cursor);
+        return -1;
+    }
+
+    for (i = 0; i < s->count; i++) {
+        k = cursor[assign[i]]++;
+        memcpy(grouped + (size_t) k * s->row_size, s->vectors + (size_t) i * s->row_size,
+               s->row_size * sizeof(float));
+        grouped_ids[k] = s->ids[i];
+    }
+
+    free(s->vectors);
+    flb_free(s->ids);
+    s->vectors = grouped;
+    s->ids = grouped_ids;
+
+    flb_free(assign);
+    flb_free(cursor);
+
+    return 0;
+}
+
+/* reference file: native float32 embeddings of 'dim' values, one after the other */
+static int load_references(struct flb_filter_instance *ins,
+                           struct flb_tf_similarity *s, const char *path)
+{
+    int i;
+    long size;
+    FILE *fp;
+
+    fp = fopen(path, "rb");
+    if (!fp) {
+        flb_errno();
+        flb_plg_error(ins, "cannot open reference file %s", path);
+        return -1;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (size <= 0 || size % (s->dim * sizeof(float)) != 0) {
+        flb_plg_error(ins, "reference file size (%ld bytes) is not a multiple of "
+                      "the embedding size (%d float32 values)!", size, s->dim);
+        fclose(fp);
+        return -1;
+    }
+
+    s->count = size / (s->dim * sizeof(float));
+    s->vectors = rows_create(s->count, s->row_size);
+    s->ids = flb_malloc(s->count * sizeof(int));
+    if (!s->vectors || !s->ids) {
+        flb_errno();
+        fclose(fp);
+        return -1;
+    }
+
+    for (i = 0; i < s->count; i++) {
+        if (fread(s->vectors + (size_t) i * s->row_size, sizeof(float), s->dim, fp) != s->dim) {
+            flb_plg_error(ins, "error reading reference file %s", path);
+            fclose(fp);
+            return -1;
+        }
+
+        if (s->metric == SIMILARITY_COSINE) {
+            normalize(s->vectors + (size_t) i * s->row_size, s->row_size);
+        }
+        s->ids[i] = i;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+struct flb_tf_similarity *flb_tf_similarity_create(struct flb_filter_instance *ins,
+                                                   const char *path, int dim,
+                                                   int metric, int top_k,
+                                                   int nlist, int nprobe)
+{
+    struct flb_tf_similarity *s;
+
+    s = flb_calloc(1, sizeof(struct flb_tf_similarity));
+    if (!s) {
+        flb_errno();
+        return NULL;
+    }
+
+    s->metric = metric;
+    s->dim = dim;
+    s->row_size = (dim + ROW_FLOATS - 1) / ROW_FLOATS * ROW_FLOATS;
+
+    if (load_references(ins, s, path) == -1) {
+        flb_tf_similarity_destroy(s);
+        return NULL;
+    }
+
+    s->top_k = top_k < s->count ? top_k : s->count;
+    s->query = rows_create(1, s->row_size);
+    s->top_ids = flb_malloc(s->top_k * sizeof(int));
+    s->top_scores = flb_malloc(s->top_k * sizeof(float));
+    if (!s->query || !s->top_ids || !s->top_scores) {
+        flb_errno();
+        flb_tf_similarity_destroy(s);
+        return NULL;
+    }
+
+    if (nlist > 0) {
+        s->nlist = nlist < s->count ? nlist : s->count;
+        s->nprobe = nprobe < 1 ? 1 : (nprobe < s->nlist ? nprobe : s->nlist);
+        s->probe_lists = flb_malloc(s->nprobe * sizeof(int));
+        s->probe_scores = flb_malloc(s->nprobe * sizeof(float));
+        if (!s->probe_lists || !s->probe_scores || build_ivf(s) == -1) {
+            flb_plg_error(ins, "error building the IVF index of the references");
+            flb_tf_similarity_destroy(s);
+            return NULL;
+        }
+    }
+
+    flb_plg_info(ins, "loaded %d reference embeddings of dimension %d (%s, %s)",
+                 s->count, s->dim,
+                 s->metric == SIMILARITY_COSINE ? "cosine" : "dot product",
+                 s->nlist ? "ivf" : "exhaustive search");
+
+    return s;
+}
+
+int flb_tf_similarity_search(struct flb_tf_similarity *s, const float *query)
+{
+    int i;
+    int l;
+    int n;
+    int probes;
+
+    /* padding values of the query stay zero */
+    memcpy(s->query, query, s->dim * sizeof(float));
+    if (s->metric == SIMILARITY_COSINE) {
+        normalize(s->query, s->row_size);
+    }
+
+    n = 0;
+    if (s->nlist == 0) {
+        scan_rows(s, 0, s->count, &n);
+        return n;
+    }
+
+    /* scan the partitions with the closest centroids */
+    probes = 0;
+    for (l = 0; l < s->nlist; l++) {
+        top_k_insert(s->probe_lists, s->probe_scores, &probes, s->nprobe, l,
+                     dot_product(s->query, s->centroids + (size_t) l * s->row_size,
+                                 s->row_size));
+    }
+
+    for (i = 0; i < probes; i++) {
+        l = s->probe_lists[i];
+        scan_rows(s, s->list_offsets[l], s->list_offsets[l + 1], &n);
+    }
+
+    return n;
+}
+
+void flb_tf_similarity_destroy(struct flb_tf_similarity *s)
+{
+    /* aligned buffers are allocated with posix_memalign */
+    free(s->vectors);
+    free(s->centroids);
+    free(s->query);
+
+    flb_free(s->ids);
+    flb_free(s->list_offsets);
+    flb_free(s->probe_lists);
+    flb_free(s->probe_scores);
+    flb_free(s->top_ids);
+    flb_free(s->top_scores);
+    flb_free(s);
+}
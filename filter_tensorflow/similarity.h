@@ -0,0 +1,66 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2019-2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_TF_SIMILARITY_H
+#define FLB_FILTER_TF_SIMILARITY_H
+
+enum similarity_metric {
+    SIMILARITY_DOT,
+    SIMILARITY_COSINE
+};
+
+/*
+ * reference embeddings, stored as a contiguous matrix of 64-byte aligned rows
+ * (zero-padded to a multiple of 16 floats). With an IVF index the rows are
+ * grouped by partition, and ids maps a row back to its position in the file.
+ */
+struct flb_tf_similarity {
+    int metric;
+    int dim;
+    int row_size;
+    int count;
+    float *vectors;
+    int *ids;
+
+    /* IVF partitions (nlist == 0: exhaustive search) */
+    int nlist;
+    int nprobe;
+    float *centroids;
+    int *list_offsets;
+    int *probe_lists;
+    float *probe_scores;
+
+    /* per-query buffers */
+    float *query;
+    int top_k;
+    int *top_ids;
+    float *top_scores;
+};
+
+struct flb_tf_similarity *flb_tf_similarity_create(struct flb_filter_instance *ins,
+                                                   const char *path, int dim,
+                                                   int metric, int top_k,
+                                                   int nlist, int nprobe);
+
+/* search the references, returns the number of matches in top_ids/top_scores */
+int flb_tf_similarity_search(struct flb_tf_similarity *s, const float *query);
+
+void flb_tf_similarity_destroy(struct flb_tf_similarity *s);
+
+#endif
@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2019-2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <string.h>
+
+#include <fluent-bit/flb_filter_plugin.h>
+
+#include "temporal.h"
+
+/* FNV-1a: tags are identified by their hash and length, so no tag is copied */
+static uint64_t tag_hash(const char *tag, int tag_len)
+{
+    int i;
+    uint64_t h = 14695981039346656037ULL;
+
+    for (i = 0; i < tag_len; i++) {
+        h ^= (unsigned char) tag[i];
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+static void state_reset(struct flb_tf_temporal *t, struct flb_tf_tag_state *s)
+{
+    s->count = 0;
+    s->label = -1;
+    memset(s->sum, 0, t->classes * sizeof(float));
+}
+
+struct flb_tf_temporal *flb_tf_temporal_create(int mode, int classes,
+                                               int window_records, int window_ms,
+                                               float transition_high, float transition_low)
+{
+    int i;
+    struct flb_tf_temporal *t;
+
+    t = flb_calloc(1, sizeof(struct flb_tf_temporal));
+    if (!t) {
+        flb_errno();
+        return NULL;
+    }
+
+    t->mode = mode;
+    t->classes = classes;
+    t->window_records = window_records;
+    t->window_ms = window_ms;
+    t->transition_high = transition_high;
+    t->transition_low = transition_low;
+
+    /* sum and max of every state, in one buffer */
+    t->values = flb_malloc(FLB_TF_TAG_STATES * 2 * classes * sizeof(float));
+    t->mean = flb_malloc(classes * sizeof(float));
+    if (!t->values || !t->mean) {
+        flb_errno();
+        flb_tf_temporal_destroy(t);
+        return NULL;
+    }
+
+    for (i = 0; i < FLB_TF_TAG_STATES; i++) {
+        t->states[i].sum = t->values + 2 * i * classes;
+        t->states[i].max = t->states[i].sum + classes;
+    }
+
+    return t;
+}
+
+struct flb_tf_tag_state *flb_tf_temporal_state(struct flb_tf_temporal *t,
+                                               const char *tag, int tag_len)
+{
+    int i;
+    uint64_t h;
+    struct flb_tf_tag_state *s;
+    struct flb_tf_tag_state *lru;
+
+    h = tag_hash(tag, tag_len);
+    t->uses++;
+
+    for (i = 0; i < t->state_count; i++) {
+        s = &t->states[i];
+        if (s->tag_hash == h && s->tag_len == tag_len) {
+            s->last_use = t->uses;
+            return s;
+        }
+    }
+
+    if (t->state_count < FLB_TF_TAG_STATES) {
+        s = &t->states[t->state_count++];
+    }
+    else {
+        lru = &t->states[0];
+        for (i = 1; i < FLB_TF_TAG_STATES; i++) {
+            if (t->states[i].last_use < lru->last_use) {
+                lru = &t->states[i];
+            }
+        }
+        s = lru;
+        t->evicted++;
+    }
+
+    s->tag_hash = h;
+    s->tag_len = tag_len;
+    s->last_use = t->uses;
+    state_reset(t, s);
+
+    return s;
+}
+
+int flb_tf_temporal_window_expired(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                                   struct flb_time *tm)
+{
+    double elapsed_ms;
+
+    if (t->window_ms <= 0 || s->count == 0) {
+        return FLB_FALSE;
+    }
+
+    /* windows are measured on the record timestamps */
+    elapsed_ms = (tm->tm.tv_sec - s->start.tm.tv_sec) * 1000.0 +
+                 (tm->tm.tv_nsec - s->start.tm.tv_nsec) / 1000000.0;
+
+    return elapsed_ms >= t->window_ms;
+}
+
+int flb_tf_temporal_window_add(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                               const float *output, struct flb_time *tm)
+{
+    int i;
+
+    if (s->count == 0) {
+        s->start = *tm;
+        memcpy(s->max, output, t->classes * sizeof(float));
+    }
+    else {
+        for (i = 0; i < t->classes; i++) {
+            if (output[i] > s->max[i]) {
+                s->max[i] = output[i];
+            }
+        }
+    }
+
+    for (i = 0; i < t->classes; i++) {
+        s->sum[i] += output[i];
+    }
+    s->count++;
+    s->end = *tm;
+
+    return t->window_records > 0 && s->count >= t->window_records;
+}
+
+void flb_tf_temporal_window_mean(struct flb_tf_temporal *t, struct flb_tf_tag_state *s)
+{
+    int i;
+
+    for (i = 0; i < t->classes; i++) {
+        t->mean[i] = s->sum[i] / s->count;
+    }
+
+    /* the max is overwritten by the first record of the next window */
+    s->count = 0;
+    memset(s->sum, 0, t->classes * sizeof(float));
+}
+
+int flb_tf_temporal_transition(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                               const float *output, int *previous)
+{
+    int i;
+    int top = 0;
+    int label;
+
+    for (i = 1; output && i < t->classes; i++) {
+        if (output[i] > output[top]) {
+            top = i;
+        }
+    }
+
+    /* the label is held until it drops below the low band ... */
+    label = s->label;
+    if (!output) {
+        /* nothing detected (the gate model didn't let the record through) */
+        label = -1;
+    }
+    else if (label >= 0 && output[label] < t->transition_low) {
+        label = -1;
+    }
+
+    /* ... unless another label reaches the high band */
+    if (output && top != label && output[top] >= t->transition_high) {
+        label = top;
+    }
+
+    if (label == s->label) {
+        return FLB_FALSE;
+    }
+
+    *previous = s->label;
+    s->label = label;
+
+    return FLB_TRUE;
+}
+
+void flb_tf_temporal_destroy(struct flb_tf_temporal *t)
+{
+    flb_free(t->values);
+    flb_free(t->mean);
+    flb_free(t);
+}
@@ -0,0 +1,114 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2019-2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_FILTER_TF_TEMPORAL_H
+#define FLB_FILTER_TF_TEMPORAL_H
+
+#include <stdint.h>
+#include <fluent-bit/flb_time.h>
+
+/* tags (i.e. streams of records) the state is kept for */
+#define FLB_TF_TAG_STATES 32
+
+struct flb_tf_tag_state {
+    uint64_t tag_hash;
+    int tag_len;
+    uint64_t last_use;
+
+    /* window mode: outputs summed up since the first record of the window */
+    int count;
+    struct flb_time start;
+    struct flb_time end;
+    float *sum;
+    float *max;
+
+    /* transition mode: the label held (-1: none) */
+    int label;
+};
+
+/*
+ * per-tag state of the window and transition modes. The states and their
+ * per-class buffers are allocated once, at startup.
+ */
+struct flb_tf_temporal {
+    int mode;
+    int classes;
+
+    /*
+     * tumbling windows: a window is complete after window_records records,
+     * or when a record comes window_ms or more after its first record
+     */
+    int window_records;
+    int window_ms;
+
+    /*
+     * hysteresis: a label is taken once its score reaches transition_high,
+     * and held until it drops below transition_low
+     */
+    float transition_high;
+    float transition_low;
+
+    int state_count;
+    uint64_t uses;
+    int evicted;
+    struct flb_tf_tag_state states[FLB_TF_TAG_STATES];
+    float *values;
+
+    /* mean of the window being packed */
+    float *mean;
+};
+
+struct flb_tf_temporal *flb_tf_temporal_create(int mode, int classes,
+                                               int window_records, int window_ms,
+                                               float transition_high, float transition_low);
+
+/* state of the tag, the least recently used state is recycled for new tags */
+struct flb_tf_tag_state *flb_tf_temporal_state(struct flb_tf_temporal *t,
+                                               const char *tag, int tag_len);
+
+/*
+ * true if the record (at tm) falls outside the window of its tag, to be
+ * checked before the record is added: the window is then complete, and reset
+ * by flb_tf_temporal_window_mean before the record starts a new one.
+ */
+int flb_tf_temporal_window_expired(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                                   struct flb_time *tm);
+
+/*
+ * add the output of a record to the window of its tag. Returns true if the
+ * window is complete (window_records): the window is then reset by
+ * flb_tf_temporal_window_mean.
+ */
+int flb_tf_temporal_window_add(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                               const float *output, struct flb_time *tm);
+
+/* mean of the window into t->mean, and start a new window */
+void flb_tf_temporal_window_mean(struct flb_tf_temporal *t, struct flb_tf_tag_state *s);
+
+/*
+ * update the label held for the tag (output is NULL if nothing has been
+ * detected). Returns true if it has changed, with the previous label in
+ * previous.
+ */
+int flb_tf_temporal_transition(struct flb_tf_temporal *t, struct flb_tf_tag_state *s,
+                               const float *output, int *previous);
+
+void flb_tf_temporal_destroy(struct flb_tf_temporal *t);
+
+#endif
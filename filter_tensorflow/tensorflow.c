@@ -17,6 +17,11 @@
  *  limitations under the License.
  */
 
+/* cpu_set_t and pthread_setaffinity_np (thread_placement.h) */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <unistd.h>
 
@@ -24,14 +29,24 @@
 #include <fluent-bit/flb_utils.h>
 #include <fluent-bit/flb_time.h>
 #include <fluent-bit/flb_config_map.h>
+#include <fluent-bit/flb_slist.h>
+#include <fluent-bit/flb_router.h>
 
 #include "tensorflow/lite/c/c_api.h"
 #include "tensorflow/lite/c/common.h"
 #include "tensorflow/lite/delegates/gpu/delegate.h"
 
+#include <cmetrics/cmt_counter.h>
+
 #include <msgpack.h>
+#include <math.h>
 #include <time.h>
+#include "frame_ring.h"
+#include "thread_placement.h"
+#include "trace.h"
 #include "tensorflow.h"
+#include "similarity.h"
+#include "temporal.h"
 #include "gpu.h"
 
 /* https://github.com/msgpack/msgpack-c/wiki/v2_0_c_overview */
@@ -51,6 +66,32 @@ enum device {
   DEVICE_GPU
 };
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
+/* weight of the last sample in the invoke latency and arrival interval moving averages */
+#define INVOKE_LATENCY_EWMA_ALPHA 0.2
+
+/* monotonic clock in milliseconds, used for latency measurements */
+static double monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* interpreter cancellation hook, called by TensorFlow Lite between the ops */
+static bool invoke_deadline_exceeded(void *data)
+{
+    struct flb_tensorflow *ctx = data;
+
+    return monotonic_ms() > ctx->invoke_deadline;
+}
+
 void print_tensor_info(struct flb_tensorflow *ctx, const TfLiteTensor* tensor)
 {
     int i;
@@ -70,34 +111,146 @@ void print_tensor_info(struct flb_tensorflow *ctx, const TfLiteTensor* tensor)
     flb_plg_info(ctx->ins, "%s", tensor_info);
 }
 
-void print_model_io(struct flb_tensorflow *ctx)
+void print_model_io(struct flb_tensorflow *ctx, struct flb_tf_model *m)
 {
     int i;
     int num;
     const TfLiteTensor* tensor;
 
     /* Input information */
-    num = TfLiteInterpreterGetInputTensorCount(ctx->interpreter);
+    num = TfLiteInterpreterGetInputTensorCount(m->interpreter);
     for (i = 0; i < num; i++) {
-        tensor = TfLiteInterpreterGetInputTensor(ctx->interpreter, i);
+        tensor = TfLiteInterpreterGetInputTensor(m->interpreter, i);
         flb_plg_info(ctx->ins, " ===== input #%d =====", i + 1);
         print_tensor_info(ctx, tensor);
     }
 
     /* Output information */
-    num = TfLiteInterpreterGetOutputTensorCount(ctx->interpreter);
+    num = TfLiteInterpreterGetOutputTensorCount(m->interpreter);
     for (i = 0; i < num; i++) {
-        tensor = TfLiteInterpreterGetOutputTensor(ctx->interpreter, i);
+        tensor = TfLiteInterpreterGetOutputTensor(m->interpreter, i);
         flb_plg_info(ctx->ins, " ===== output #%d ====", i + 1);
         print_tensor_info(ctx, tensor);
     }
 }
 
-void build_interpreter(struct flb_tensorflow *ctx, char* model_path)
+/* offsets of the tiles along one axis, the last tile is aligned to the frame edge */
+static int tile_positions(int frame_size, int tile_size, int stride, int *positions)
+{
+    int n = 0;
+    int pos;
+
+    for (pos = 0; pos + tile_size < frame_size; pos += stride) {
+        if (positions) {
+            positions[n] = pos;
+        }
+        n++;
+    }
+
+    if (positions) {
+        positions[n] = frame_size - tile_size;
+    }
+
+    return n + 1;
+}
+
+/*
+ * cut the frame into tiles of the model input size and resize the batch
+ * dimension of the model input to the number of tiles
+ */
+static int setup_tiles(struct flb_tensorflow *ctx, struct flb_tf_model *m)
+{
+    int i;
+    int nx;
+    int ny;
+    int stride_x;
+    int stride_y;
+    int *xs;
+    int *ys;
+    int dims[4];
+    const TfLiteTensor* tensor;
+
+    tensor = TfLiteInterpreterGetInputTensor(m->interpreter, 0);
+    if (TfLiteTensorNumDims(tensor) != 4 || TfLiteTensorDim(tensor, 0) != 1) {
+        flb_plg_error(ctx->ins, "tiled inference requires a model input of "
+                      "dimensions {1, height, width, channels}!");
+        return -1;
+    }
+
+    /* tiles are set by the main model, and the gate model has to match them */
+    if (ctx->tiles) {
+        if (TfLiteTensorDim(tensor, 1) != ctx->tile_height ||
+            TfLiteTensorDim(tensor, 2) != ctx->tile_width ||
+            TfLiteTensorDim(tensor, 3) != ctx->tile_channels) {
+            flb_plg_error(ctx->ins, "model input doesn't match the tile size!");
+            return -1;
+        }
+    }
+    else {
+        ctx->tile_height = TfLiteTensorDim(tensor, 1);
+        ctx->tile_width = TfLiteTensorDim(tensor, 2);
+        ctx->tile_channels = TfLiteTensorDim(tensor, 3);
+
+        if (ctx->tile_frame_width < ctx->tile_width ||
+            ctx->tile_frame_height < ctx->tile_height) {
+            flb_plg_error(ctx->ins, "frame size (%dx%d) is smaller than the model input (%dx%d)!",
+                          ctx->tile_frame_width, ctx->tile_frame_height,
+                          ctx->tile_width, ctx->tile_height);
+            return -1;
+        }
+
+        /* no overlap by default */
+        stride_x = ctx->tile_stride > 0 ? ctx->tile_stride : ctx->tile_width;
+        stride_y = ctx->tile_stride > 0 ? ctx->tile_stride : ctx->tile_height;
+
+        nx = tile_positions(ctx->tile_frame_width, ctx->tile_width, stride_x, NULL);
+        ny = tile_positions(ctx->tile_frame_height, ctx->tile_height, stride_y, NULL);
+
+        xs = flb_malloc(nx * sizeof(int));
+        ys = flb_malloc(ny * sizeof(int));
+        ctx->tiles = flb_malloc(nx * ny * sizeof(struct tile_offset));
+        if (!xs || !ys || !ctx->tiles) {
+            flb_errno();
+            flb_free(xs);
+            flb_free(ys);
+            return -1;
+        }
+
+        tile_positions(ctx->tile_frame_width, ctx->tile_width, stride_x, xs);
+        tile_positions(ctx->tile_frame_height, ctx->tile_height, stride_y, ys);
+
+        for (i = 0; i < nx * ny; i++) {
+            ctx->tiles[i].x = xs[i % nx];
+            ctx->tiles[i].y = ys[i / nx];
+        }
+        ctx->tile_count = nx * ny;
+
+        flb_free(xs);
+        flb_free(ys);
+
+        flb_plg_info(ctx->ins, "tiled inference: %d tiles (%d x %d) of %dx%d pixels",
+                     ctx->tile_count, nx, ny, ctx->tile_width, ctx->tile_height);
+    }
+
+    dims[0] = ctx->tile_count;
+    dims[1] = ctx->tile_height;
+    dims[2] = ctx->tile_width;
+    dims[3] = ctx->tile_channels;
+    if (TfLiteInterpreterResizeInputTensor(m->interpreter, 0, dims, 4) != kTfLiteOk) {
+        flb_plg_error(ctx->ins, "Error resizing the model input to a batch of %d tiles!",
+                      ctx->tile_count);
+        return -1;
+    }
+    m->batch_size = ctx->tile_count;
+
+    return 0;
+}
+
+void build_interpreter(struct flb_tensorflow *ctx, struct flb_tf_model *m, char* model_path)
 {
     /* from c_api.h */
-    ctx->model = TfLiteModelCreateFromFile(model_path);
-    ctx->interpreter_options = TfLiteInterpreterOptionsCreate();
+    m->model = TfLiteModelCreateFromFile(model_path);
+    m->interpreter_options = TfLiteInterpreterOptionsCreate();
 
     /* GPU delegate
          https://www.tensorflow.org/lite/performance/gpu#c-until-2.3.0
@@ -105,36 +258,90 @@ void build_interpreter(struct flb_tensorflow *ctx, char* model_path)
        TfLiteInterpreterOptionsAddDelegate(ctx->interpreter_options, delegate);
     */
 
-    ctx->interpreter = TfLiteInterpreterCreate(ctx->model, ctx->interpreter_options);
+    if (ctx->inference_threads > 0) {
+        TfLiteInterpreterOptionsSetNumThreads(m->interpreter_options, ctx->inference_threads);
+    }
+
+    m->interpreter = TfLiteInterpreterCreate(m->model, m->interpreter_options);
+
+    if (m->interpreter && ctx->max_invoke_ms > 0) {
+        TfLiteInterpreterSetCancellationFunction(m->interpreter, ctx, invoke_deadline_exceeded);
+    }
+
+    /* the batch size has to be set before the graph is handed over to a delegate */
+    if (m->interpreter && ctx->tile_frame_width > 0) {
+        if (setup_tiles(ctx, m) == -1) {
+            TfLiteInterpreterDelete(m->interpreter);
+            m->interpreter = NULL;
+            return;
+        }
+    }
 
     if (ctx->device == DEVICE_GPU) {
 
         TfLiteGpuDelegateOptionsV2 options = TfLiteGpuDelegateOptionsV2Default();
         TfLiteDelegate* delegate = TfLiteGpuDelegateV2Create(&options);
-        if (TfLiteInterpreterModifyGraphWithDelegate(ctx->interpreter, delegate) != kTfLiteOk) {
+        if (TfLiteInterpreterModifyGraphWithDelegate(m->interpreter, delegate) != kTfLiteOk) {
             flb_plg_error(ctx->ins, "Error modifying the graph with GPU delegate!");
             /* TODO: cleanups */
             return;
         }
 
-        ctx->delegate = delegate;
+        m->delegate = delegate;
     }
 
-    TfLiteInterpreterAllocateTensors(ctx->interpreter);
+    TfLiteInterpreterAllocateTensors(m->interpreter);
 
     flb_plg_info(ctx->ins, "TensorFlow Lite interpreter created!");
-    print_model_io(ctx);
+    print_model_io(ctx, m);
 }
 
-void inference(TfLiteInterpreter* interpreter, void* input_data, void* output_data, int input_buf_size, int output_buf_size) {
+TfLiteStatus inference(TfLiteInterpreter* interpreter, void* input_data, void* output_data, int input_buf_size, int output_buf_size) {
+    TfLiteStatus status;
+
     /* from c_api.h */
     TfLiteTensor* input_tensor = TfLiteInterpreterGetInputTensor(interpreter, 0);
     TfLiteTensorCopyFromBuffer(input_tensor, input_data, input_buf_size);
 
-    TfLiteInterpreterInvoke(interpreter);
+    status = TfLiteInterpreterInvoke(interpreter);
+    if (status != kTfLiteOk) {
+        return status;
+    }
 
     const TfLiteTensor* output_tensor = TfLiteInterpreterGetOutputTensor(interpreter, 0);
     TfLiteTensorCopyToBuffer(output_tensor, output_data, output_buf_size);
+
+    return kTfLiteOk;
+}
+
+/*
+ * run the inference of a model with the invoke watchdog armed. Returns 0 on
+ * success, 1 if the invoke has been cancelled on timeout and -1 on error.
+ */
+static int model_invoke(struct flb_tensorflow *ctx, struct flb_tf_model *m, void *input)
+{
+    TfLiteStatus status;
+
+    if (ctx->max_invoke_ms > 0) {
+        ctx->invoke_deadline = monotonic_ms() + ctx->max_invoke_ms;
+    }
+
+    status = inference(m->interpreter, input, m->output,
+                       m->input_byte_size, m->output_byte_size);
+
+    if (status == kTfLiteOk) {
+        return 0;
+    }
+
+    if (ctx->max_invoke_ms > 0 && monotonic_ms() > ctx->invoke_deadline) {
+        ctx->timeout_records++;
+        cmt_counter_inc(ctx->cmt_timeout_records, cmt_time_now(), 1,
+                        (char *[]) {(char *) flb_filter_name(ctx->ins)});
+        return 1;
+    }
+
+    flb_plg_error(ctx->ins, "Error invoking the interpreter!");
+    return -1;
 }
 
 int allocateIOBuffer(struct flb_tensorflow *ctx, void** buf, TfLiteType type, int size)
@@ -150,20 +357,184 @@ int allocateIOBuffer(struct flb_tensorflow *ctx, void** buf, TfLiteType type, in
     return 0;
 }
 
-void flb_tensorflow_conf_destroy(struct flb_tensorflow *ctx)
+void flb_tf_model_destroy(struct flb_tensorflow *ctx, struct flb_tf_model *m)
 {
-    flb_sds_destroy(ctx->input_field);
+    if (m->path) {
+        flb_sds_destroy(m->path);
+    }
+
+    if (m->input) {
+        flb_free(m->input);
+    }
+
+    if (m->output) {
+        flb_free(m->output);
+    }
+
+    /* delete TensorFlow model and interpreter */
+    if (m->model) {
+        TfLiteModelDelete(m->model);
+    }
+
+    if (ctx->device == DEVICE_GPU && m->delegate) {
+        TfLiteGpuDelegateV2Delete(m->delegate);
+    }
+
+    TfLiteInterpreterOptionsDelete(m->interpreter_options);
+    TfLiteInterpreterDelete(m->interpreter);
+
+    flb_free(m);
+}
+
+/*
+ * load a model file, build its interpreter and allocate the IO buffers
+ * based on the shapes of the first input and output tensors
+ */
+static struct flb_tf_model *model_load(struct flb_tensorflow *ctx, const char *model_path)
+{
+    int i;
+    struct flb_tf_model *m;
+    const TfLiteTensor* tensor;
+
+    if(access(model_path, F_OK) == -1) {
+        flb_plg_error(ctx->ins, "TensorFlow Lite model file %s not found!", model_path);
+        return NULL;
+    }
+
+    m = flb_calloc(1, sizeof(struct flb_tf_model));
+    if (!m) {
+        flb_errno();
+        return NULL;
+    }
+    m->batch_size = 1;
+    m->path = flb_sds_create(model_path);
+
+    build_interpreter(ctx, m, (char *) model_path);
+
+    if (!m->interpreter) {
+        flb_plg_error(ctx->ins, "Error creating the interpreter");
+        flb_tf_model_destroy(ctx, m);
+        return NULL;
+    }
+
+    /* calculate input information */
+    m->input_tensor_size = 1;
+    tensor = TfLiteInterpreterGetInputTensor(m->interpreter, 0);
+    for (i = 0; i < TfLiteTensorNumDims(tensor); i++) {
+        m->input_tensor_size *= TfLiteTensorDim(tensor, i);
+    }
+    m->input_tensor_type = TfLiteTensorType(tensor);
+    if (allocateIOBuffer(ctx, &m->input, m->input_tensor_type, m->input_tensor_size) == -1) {
+        flb_tf_model_destroy(ctx, m);
+        return NULL;
+    }
+    m->input_byte_size = TfLiteTensorByteSize(tensor);
+
+    /* calculate output information */
+    m->output_tensor_size = 1;
+    tensor = TfLiteInterpreterGetOutputTensor(m->interpreter, 0);
+    for (i = 0; i < TfLiteTensorNumDims(tensor); i++) {
+        m->output_tensor_size *= TfLiteTensorDim(tensor, i);
+    }
+    m->output_tensor_type = TfLiteTensorType(tensor);
+    if (allocateIOBuffer(ctx, &m->output, m->output_tensor_type, m->output_tensor_size) == -1) {
+        flb_tf_model_destroy(ctx, m);
+        return NULL;
+    }
+    m->output_byte_size = TfLiteTensorByteSize(tensor);
+
+    return m;
+}
+
+/*
+ * TensorFlow Lite starts its worker threads from the thread that builds the
+ * interpreter or runs its first invoke, and the workers inherit the CPUs and
+ * scheduling policy of that thread. While a model is loaded, the init thread
+ * takes the inference placement, and gets its own back afterwards. Returns
+ * true if the placement has been taken.
+ */
+static int enter_inference_placement(struct flb_tensorflow *ctx,
+                                     struct thread_placement *saved)
+{
+    int err_cpus;
+    int err_sched;
+
+    if (!ctx->inference_placement.has_cpus && !ctx->inference_placement.has_sched) {
+        return FLB_FALSE;
+    }
+
+    if (thread_placement_get(pthread_self(), saved) == -1) {
+        flb_plg_warn(ctx->ins, "could not get the placement of the init thread, "
+                     "inference threads are not placed");
+        return FLB_FALSE;
+    }
+
+    thread_placement_apply(pthread_self(), &ctx->inference_placement, &err_cpus, &err_sched);
+
+    if (err_cpus) {
+        flb_plg_warn(ctx->ins, "could not set the CPUs of the inference threads: %s",
+                     strerror(err_cpus));
+    }
+    if (err_sched) {
+        flb_plg_warn(ctx->ins, "could not set the scheduling policy of the inference threads: %s%s",
+                     strerror(err_sched), err_sched == EPERM ?
+                     " (real-time policies require CAP_SYS_NICE or RLIMIT_RTPRIO)" : "");
+    }
+
+    return FLB_TRUE;
+}
+
+static void leave_inference_placement(struct flb_tensorflow *ctx,
+                                      struct thread_placement *saved)
+{
+    int err_cpus;
+    int err_sched;
+
+    thread_placement_apply(pthread_self(), saved, &err_cpus, &err_sched);
+    if (err_cpus || err_sched) {
+        flb_plg_warn(ctx->ins, "could not restore the placement of the init thread");
+    }
+}
+
+/*
+ * load a model with the inference placement. The model is warmed up with an
+ * invoke on a zero input, so that the worker threads are started while the
+ * placement is in effect rather than on the first record.
+ */
+struct flb_tf_model *flb_tf_model_create(struct flb_tensorflow *ctx, const char *model_path)
+{
+    int placed;
+    char desc[256];
+    struct thread_placement saved;
+    struct flb_tf_model *m;
 
-    if (ctx->input) {
-        flb_free(ctx->input);
+    placed = enter_inference_placement(ctx, &saved);
+
+    m = model_load(ctx, model_path);
+    if (m && placed) {
+        memset(m->input, 0, m->input_byte_size);
+        ctx->invoke_deadline = INFINITY;
+        inference(m->interpreter, m->input, m->output, m->input_byte_size, m->output_byte_size);
+
+        thread_placement_describe(pthread_self(), desc, sizeof(desc));
+        flb_plg_info(ctx->ins, "inference threads of %s: %s", model_path, desc);
     }
 
-    if (ctx->output) {
-        flb_free(ctx->output);
+    if (placed) {
+        leave_inference_placement(ctx, &saved);
     }
 
-    if (ctx->normalization_value) {
-        flb_free(ctx->normalization_value);
+    return m;
+}
+
+void flb_tensorflow_conf_destroy(struct flb_tensorflow *ctx)
+{
+    int i;
+
+    flb_sds_destroy(ctx->input_field);
+
+    if (ctx->pre.normalization_value) {
+        flb_free(ctx->pre.normalization_value);
     }
 
     if (ctx->out_ordering_buffer.ordered_output) {
@@ -174,119 +545,1161 @@ void flb_tensorflow_conf_destroy(struct flb_tensorflow *ctx)
         flb_free(ctx->out_ordering_buffer.ordered_output_idx);
     }
 
-    /* delete TensorFlow model and interpreter */
-    if (ctx->model) {
-        TfLiteModelDelete(ctx->model);
+    if (ctx->tiles) {
+        flb_free(ctx->tiles);
     }
 
-    if (ctx->device == DEVICE_GPU && ctx->delegate) {
-        TfLiteGpuDelegateV2Delete(ctx->delegate);
+    if (ctx->similarity) {
+        flb_tf_similarity_destroy(ctx->similarity);
     }
 
-    TfLiteInterpreterOptionsDelete(ctx->interpreter_options);
-    TfLiteInterpreterDelete(ctx->interpreter);
+    if (ctx->temporal) {
+        flb_tf_temporal_destroy(ctx->temporal);
+    }
 
-    flb_free(ctx);
-}
+    if (ctx->record_id_field) {
+        flb_sds_destroy(ctx->record_id_field);
+    }
 
-static int cb_tensorflow_init(struct flb_filter_instance *f_ins,
-                              struct flb_config *config,
-                              void *data)
-{
-    int i;
-    int ret;
-    struct flb_tensorflow *ctx = NULL;
-    const char *tmp;
-    const TfLiteTensor* tensor;
+    if (ctx->batch_timestamps) {
+        flb_free(ctx->batch_timestamps);
+    }
 
-    ctx = flb_calloc(1, sizeof(struct flb_tensorflow));
-    if (!ctx) {
-        flb_errno();
-        return -1;
+    if (ctx->batch_ids) {
+        flb_free(ctx->batch_ids);
     }
 
-    ret = flb_filter_config_map_set(f_ins, (void *) ctx);
-    if (ret == -1) {
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+    if (ctx->batch_output) {
+        flb_free(ctx->batch_output);
     }
 
-    ctx->ins = f_ins;
+    if (ctx->model) {
+        flb_tf_model_destroy(ctx, ctx->model);
+    }
 
-    tmp = flb_filter_get_property("input_field", f_ins);
-    if (!tmp) {
-        flb_plg_error(ctx->ins, "input field is not defined!");
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+    for (i = 0; i < ctx->route_count; i++) {
+        flb_sds_destroy(ctx->routes[i].match);
     }
 
-    ctx->input_field = flb_sds_create(tmp);
+    for (i = 0; i < ctx->model_count; i++) {
+        flb_tf_model_destroy(ctx, ctx->models[i]);
+    }
 
-    tmp = flb_filter_get_property("device", f_ins);
-    if (!tmp) {
-        flb_plg_error(ctx->ins, "device field is not defined!");
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+    if (ctx->gate) {
+        flb_tf_model_destroy(ctx, ctx->gate);
     }
 
-    if (strcasecmp(tmp, "cpu") == 0) {
-        ctx->device = DEVICE_CPU;
+    for (i = 0; i < ctx->frame_ring_count; i++) {
+        frame_ring_destroy(&ctx->frame_rings[i]);
     }
-    else if (strcasecmp(tmp, "gpu") == 0) {
-        ctx->device = DEVICE_GPU;
+
+    if (ctx->trace) {
+        flb_plg_info(ctx->ins, "trace written, %lu spans dropped", trace_dropped(ctx->trace));
+        trace_destroy(ctx->trace);
+    }
+
+    flb_free(ctx);
+}
+
+/* bytes per element of the binary input encodings */
+static const int input_encoding_size[] = {
+    [INPUT_ENCODING_U8] = 1,
+    [INPUT_ENCODING_I8] = 1,
+    [INPUT_ENCODING_U16] = 2,
+    [INPUT_ENCODING_F16] = 2,
+    [INPUT_ENCODING_F32] = 4,
+    [INPUT_ENCODING_I32] = 4
+};
+
+static inline uint16_t read_u16(const unsigned char *p, int big_endian)
+{
+    return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static inline uint32_t read_u32(const unsigned char *p, int big_endian)
+{
+    if (big_endian) {
+        return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+    return ((uint32_t) p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/* IEEE754 half precision to single precision */
+static inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0) {
+        /* zero and subnormals: mant x 2^-24 */
+        f = mant / 16777216.0f;
+        return sign ? -f : f;
+    }
+
+    if (exp == 31) {
+        bits = sign | 0x7f800000 | (mant << 13);
     }
     else {
-        flb_plg_error(ctx->ins, "device field must be \"cpu\" or \"gpu\"!");
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+/*
+ * convert count elements of the binary input to float32. Float32 inputs in
+ * the host byte order are copied as they are.
+ */
+static void decode_input(struct flb_tf_preprocess *pre, float *dst,
+                         const unsigned char *src, int count)
+{
+    int i;
+    int big = pre->input_big_endian;
+    uint32_t u32;
+
+    switch (pre->input_encoding) {
+    case INPUT_ENCODING_U8:
+        for (i = 0; i < count; i++) {
+            dst[i] = (float) src[i];
+        }
+        break;
+    case INPUT_ENCODING_I8:
+        for (i = 0; i < count; i++) {
+            dst[i] = (float) (int8_t) src[i];
+        }
+        break;
+    case INPUT_ENCODING_U16:
+        for (i = 0; i < count; i++) {
+            dst[i] = (float) read_u16(src + 2 * i, big);
+        }
+        break;
+    case INPUT_ENCODING_F16:
+        for (i = 0; i < count; i++) {
+            dst[i] = half_to_float(read_u16(src + 2 * i, big));
+        }
+        break;
+    case INPUT_ENCODING_I32:
+        for (i = 0; i < count; i++) {
+            dst[i] = (float) (int32_t) read_u32(src + 4 * i, big);
+        }
+        break;
+    case INPUT_ENCODING_F32:
+        if (big == HOST_BIG_ENDIAN) {
+            memcpy(dst, src, count * sizeof(float));
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            u32 = read_u32(src + 4 * i, big);
+            memcpy(&dst[i], &u32, sizeof(float));
+        }
+        break;
     }
+}
+
+/*
+ * copy the record value (array of numbers or binary string) into the input
+ * buffer of the model, applying normalization when it is set
+ */
+static int load_input(struct flb_tensorflow *ctx, struct flb_tf_model *m,
+                      struct flb_tf_preprocess *pre, msgpack_object value)
+{
+    int i;
+    int input_data_type;
+    float* dfloat;
+
+    /* Convention: value has to be of primitive types, or array of
+     * primitive types i.e. unrolled data (like unrolled image)
+     */
+    if (value.type == MSGPACK_OBJECT_ARRAY)
+    {
+        int size = value.via.array.size;
+        if (size == 0) {
+            flb_plg_error(ctx->ins, "input data size has to be non-zero!");
+            return -1;
+        }
+
+        if (size != m->input_tensor_size) {
+            flb_plg_error(ctx->ins, "input data size doesn't match model's input size!");
+            return -1;
+        }
+
+        /* we only accept numbers inside input array */
+        input_data_type = value.via.array.ptr[0].type;
+        if (!MSGPACK_NUMBER(input_data_type)) {
+            flb_plg_error(ctx->ins, "input data has to be of numerical type!");
+            return -1;
+        }
+
+        /* copy data from messagepack into the input buffer */
+        /* tensor type: kTfLiteFloat32 */
+        if (m->input_tensor_type == kTfLiteFloat32) {
+            /* (stackoverflow) in most implementations:
+             *  float is the IEEE754 single precision type which is 32 bits.
+             *  double is the IEEE754 64-bit double precision type
+             */
+            if (sizeof(float) != sizeof(kTfLiteFloat32)) {
+                flb_plg_error(ctx->ins, "input tensor type (kTfLiteFloat32) doesn't match float size!");
+                return -1;
+            }
+
+            dfloat = (float *) m->input;
+
+            if (MSGPACK_FLOAT(input_data_type)) {
+                for (i = 0; i < value.via.array.size; i++) {
+                    dfloat[i] = value.via.array.ptr[i].via.f64;
+
+                }
+            }
+            else if (MSGPACK_INTEGER(input_data_type)) {
+                for (i = 0; i < value.via.array.size; i++) {
+                    dfloat[i] = ((float) value.via.array.ptr[i].via.i64);
+                }
+            }
+            else {
+                flb_plg_error(ctx->ins, "input record type is not supported for a float32 input tensor!");
+                return -1;
+            }
+            /* TODO: can we set normalization_value = 1.0 and always perform the devide operation?
+             * How does it affect the performance?
+             */
+            if (pre->normalization_value) {
+                for (i = 0; i < value.via.array.size; i++) {
+                    dfloat[i] /= *pre->normalization_value;
+                }
+            }
+        }
+        else {
+            flb_plg_error(ctx->ins, "input tensor type is not currently not supported!");
+            return -1;
+        }
+    }
+    else if (value.type == MSGPACK_OBJECT_BIN) {
+        /*
+         * binaries are the serialization of the input tensor, one element
+         * of input_encoding after the other (e.g. one byte per color for
+         * images, or float32 values if they are already preprocessed)
+         */
+        if (m->input_tensor_type != kTfLiteFloat32) {
+            flb_plg_error(ctx->ins, "input tensor type is not currently not supported!");
+            return -1;
+        }
+
+        if (value.via.bin.size != (size_t) m->input_tensor_size *
+                                  input_encoding_size[pre->input_encoding]) {
+            flb_plg_error(ctx->ins, "input data size (%d bytes) doesn't match model's "
+                          "input size (%d elements of %d bytes)!", value.via.bin.size,
+                          m->input_tensor_size, input_encoding_size[pre->input_encoding]);
+            return -1;
+        }
+
+        dfloat = (float *) m->input;
+        decode_input(pre, dfloat, (const unsigned char *) value.via.bin.ptr,
+                     m->input_tensor_size);
+
+        if (pre->normalization_value) {
+            for (i = 0; i < m->input_tensor_size; i++) {
+                dfloat[i] /= *pre->normalization_value;
+            }
+        }
+    }
+    else {
+        flb_plg_error(ctx->ins, "input data format is not currently supported!");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void record_overwritten(struct flb_tensorflow *ctx)
+{
+    ctx->overwritten_records++;
+    cmt_counter_inc(ctx->cmt_overwritten_records, cmt_time_now(), 1,
+                    (char *[]) {(char *) flb_filter_name(ctx->ins)});
+}
+
+/*
+ * decide if a record is admitted for inference by model m. Returns NULL if it
+ * is, or the reason the record is skipped.
+ */
+static const char *admission_control(struct flb_tensorflow *ctx, struct flb_tf_model *m,
+                                     struct flb_time *tm)
+{
+    int stride;
+    double age_ms;
+    double interval_ms;
+    struct flb_time now;
+    char *name;
+
+    if (ctx->max_age_ms <= 0 && ctx->latency_budget_ms <= 0) {
+        return NULL;
+    }
+
+    name = (char *) flb_filter_name(ctx->ins);
+
+    flb_time_get(&now);
+    age_ms = (now.tm.tv_sec - tm->tm.tv_sec) * 1000.0 +
+             (now.tm.tv_nsec - tm->tm.tv_nsec) / 1000000.0;
+
+    /* arrival rate, from the timestamps of consecutive records */
+    if (m->has_last_record_time) {
+        interval_ms = (tm->tm.tv_sec - m->last_record_time.tm.tv_sec) * 1000.0 +
+                      (tm->tm.tv_nsec - m->last_record_time.tm.tv_nsec) / 1000000.0;
+        if (interval_ms < 0) {
+            interval_ms = 0;
+        }
+        m->arrival_interval_ewma += INVOKE_LATENCY_EWMA_ALPHA *
+            (interval_ms - m->arrival_interval_ewma);
+    }
+    m->last_record_time = *tm;
+    m->has_last_record_time = FLB_TRUE;
+
+    if (ctx->max_age_ms > 0 && age_ms > ctx->max_age_ms) {
+        ctx->stale_records++;
+        cmt_counter_inc(ctx->cmt_stale_records, cmt_time_now(), 1, (char *[]) {name});
+        return "stale";
+    }
+
+    /*
+     * a record older than the budget has been queued behind others: while
+     * there is such a backlog, only one in 'stride' records is inferred, so
+     * that the inferences take less time than the records take to arrive and
+     * the backlog drains. Without a backlog, every record is inferred.
+     */
+    if (ctx->latency_budget_ms <= 0 || age_ms <= ctx->latency_budget_ms) {
+        m->admission_seq = 0;
+        return NULL;
+    }
+
+    stride = 2;
+    if (m->arrival_interval_ewma > 0 &&
+        m->invoke_latency_ewma > stride * m->arrival_interval_ewma) {
+        stride = (int) ceil(m->invoke_latency_ewma / m->arrival_interval_ewma);
+    }
+
+    if (m->admission_seq++ % stride != 0) {
+        ctx->shed_records++;
+        cmt_counter_inc(ctx->cmt_shed_records, cmt_time_now(), 1, (char *[]) {name});
+        return "overload";
+    }
+
+    return NULL;
+}
+
+/*
+ * the frame ring a record references, mapped on first use. Rings can only be
+ * mapped by the process that created them, or one that is allowed to open
+ * its file descriptors.
+ */
+static struct frame_ring *get_frame_ring(struct flb_tensorflow *ctx,
+                                         const char *path, int path_len)
+{
+    int i;
+    char buf[sizeof(ctx->frame_rings[0].path)];
+    struct frame_ring *ring;
+
+    for (i = 0; i < ctx->frame_ring_count; i++) {
+        ring = &ctx->frame_rings[i];
+        if (strlen(ring->path) == path_len && memcmp(ring->path, path, path_len) == 0) {
+            return ring;
+        }
+    }
+
+    if (ctx->frame_ring_count == FLB_TF_FRAME_RINGS || path_len >= sizeof(buf)) {
+        flb_plg_error(ctx->ins, "too many frame rings, or invalid frame ring path");
+        return NULL;
+    }
+
+    memcpy(buf, path, path_len);
+    buf[path_len] = '\0';
+
+    ring = &ctx->frame_rings[ctx->frame_ring_count];
+    if (frame_ring_open(ring, buf) == -1) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not map frame ring %s: frames in shared memory can't "
+                      "leave the process that captured them", buf);
+        return NULL;
+    }
+    ctx->frame_ring_count++;
+
+    return ring;
+}
+
+/*
+ * frames in a shared memory ring are referenced by a map
+ *   {"ring": path, "slot": n, "seq": n, "length": n}
+ * which is resolved into a binary object pointing at the mapped slot. Returns
+ * 0 on success, 1 if the slot holds another frame by now, and -1 on errors.
+ */
+static int resolve_frame_reference(struct flb_tensorflow *ctx, msgpack_object ref,
+                                   msgpack_object *frame, struct frame_ring **ring,
+                                   uint32_t *slot, uint64_t *seq)
+{
+    int i;
+    uint64_t length = 0;
+    msgpack_object key;
+    msgpack_object val;
+    msgpack_object path = {0};
+
+    *slot = 0;
+    *seq = 0;
+
+    for (i = 0; i < ref.via.map.size; i++) {
+        key = ref.via.map.ptr[i].key;
+        val = ref.via.map.ptr[i].val;
+
+        if (key.type != MSGPACK_OBJECT_STR) {
+            continue;
+        }
+        if (key.via.str.size == 4 && memcmp(key.via.str.ptr, "ring", 4) == 0 &&
+            val.type == MSGPACK_OBJECT_STR) {
+            path = val;
+        }
+        else if (val.type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            continue;
+        }
+        else if (key.via.str.size == 4 && memcmp(key.via.str.ptr, "slot", 4) == 0) {
+            *slot = val.via.u64;
+        }
+        else if (key.via.str.size == 3 && memcmp(key.via.str.ptr, "seq", 3) == 0) {
+            *seq = val.via.u64;
+        }
+        else if (key.via.str.size == 6 && memcmp(key.via.str.ptr, "length", 6) == 0) {
+            length = val.via.u64;
+        }
+    }
+
+    if (path.type != MSGPACK_OBJECT_STR || *seq == 0) {
+        flb_plg_error(ctx->ins, "input field is neither a frame nor a frame reference!");
+        return -1;
+    }
+
+    *ring = get_frame_ring(ctx, path.via.str.ptr, path.via.str.size);
+    if (!*ring) {
+        return -1;
+    }
+
+    if (*slot >= (*ring)->slot_count || length > (*ring)->slot_size) {
+        flb_plg_error(ctx->ins, "frame reference out of the bounds of its ring!");
+        return -1;
+    }
+
+    if (!frame_ring_valid(*ring, *slot, *seq)) {
+        return 1;
+    }
+
+    frame->type = MSGPACK_OBJECT_BIN;
+    frame->via.bin.ptr = frame_ring_data(*ring, *slot);
+    frame->via.bin.size = length;
+
+    return 0;
+}
+
+/*
+ * pack the fields of the input record. The input field is replaced by the
+ * given value, so that frames referenced in a frame ring are packed inline:
+ * the reference is meaningless once the record leaves the process.
+ */
+static void pack_input_fields(msgpack_packer *pck, msgpack_object map,
+                              int input_index, msgpack_object *input)
+{
+    int i;
+
+    for (i = 0; i < map.via.map.size; i++) {
+        msgpack_pack_object(pck, map.via.map.ptr[i].key);
+        if (i == input_index && input) {
+            msgpack_pack_object(pck, *input);
+        }
+        else {
+            msgpack_pack_object(pck, map.via.map.ptr[i].val);
+        }
+    }
+}
+
+/*
+ * the sequence number of a record (e.g. the frame number of camera records)
+ * for the trace spans, or its position in the chunk if it has none
+ */
+static uint64_t record_seq(msgpack_object map, int record_idx)
+{
+    int i;
+    msgpack_object key;
+
+    for (i = 0; i < map.via.map.size; i++) {
+        key = map.via.map.ptr[i].key;
+        if (key.type == MSGPACK_OBJECT_STR && key.via.str.size == 3 &&
+            memcmp(key.via.str.ptr, "seq", 3) == 0 &&
+            map.via.map.ptr[i].val.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            return map.via.map.ptr[i].val.via.u64;
+        }
+    }
+
+    return record_idx;
+}
+
+/* skipped records keep their input fields (if requested) and the skip reason */
+static void pack_skipped_record(struct flb_tensorflow *ctx, msgpack_packer *pck,
+                                struct flb_time *tm, msgpack_object map,
+                                int input_index, msgpack_object *input,
+                                const char *reason)
+{
+    msgpack_pack_array(pck, 2);
+    flb_time_append_to_msgpack(tm, pck, 0);
+
+    if (ctx->include_input_fields) {
+        msgpack_pack_map(pck, map.via.map.size + 1);
+        pack_input_fields(pck, map, input_index, input);
+    }
+    else {
+        msgpack_pack_map(pck, 1);
+    }
+
+    msgpack_pack_str_with_body(pck, "skipped", 7);
+    msgpack_pack_str_with_body(pck, reason, strlen(reason));
+}
+
+/* copy the tiles of a binary (uint8) frame into the batched input buffer */
+static int load_tiled_input(struct flb_tensorflow *ctx, struct flb_tf_model *m,
+                            msgpack_object value)
+{
+    int t;
+    int y;
+    int k;
+    int row_size;
+    float* dfloat;
+    const unsigned char *frame;
+    const unsigned char *row;
+
+    if (value.type != MSGPACK_OBJECT_BIN) {
+        flb_plg_error(ctx->ins, "tiled inference requires binary frames!");
+        return -1;
+    }
+
+    if (value.via.bin.size != ctx->tile_frame_width * ctx->tile_frame_height * ctx->tile_channels) {
+        flb_plg_error(ctx->ins, "frame size (%d bytes) doesn't match tile_frame_width x "
+                      "tile_frame_height x %d!", value.via.bin.size, ctx->tile_channels);
+        return -1;
+    }
+
+    if (m->input_tensor_type != kTfLiteFloat32) {
+        flb_plg_error(ctx->ins, "input tensor type is not currently not supported!");
+        return -1;
+    }
+
+    dfloat = (float *) m->input;
+    frame = (const unsigned char *) value.via.bin.ptr;
+    row_size = ctx->tile_width * ctx->tile_channels;
+
+    for (t = 0; t < ctx->tile_count; t++) {
+        for (y = 0; y < ctx->tile_height; y++) {
+            row = frame + ((ctx->tiles[t].y + y) * ctx->tile_frame_width + ctx->tiles[t].x) *
+                          ctx->tile_channels;
+            for (k = 0; k < row_size; k++) {
+                *dfloat++ = (float) row[k];
+            }
+        }
+    }
+
+    if (ctx->pre.normalization_value) {
+        dfloat = (float *) m->input;
+        for (k = 0; k < m->input_tensor_size; k++) {
+            dfloat[k] /= *ctx->pre.normalization_value;
+        }
+    }
+
+    return 0;
+}
+
+/* check if the gate model lets the record through to the main model */
+static int gate_passed(struct flb_tensorflow *ctx)
+{
+    int i;
+    int batch_output_size;
+    float *gate_output;
+
+    gate_output = (float *) ctx->gate->output;
+    batch_output_size = ctx->gate->output_tensor_size / ctx->gate->batch_size;
+
+    /* with tiled inference, the record passes if any of its tiles passes */
+    for (i = 0; i < ctx->gate->output_tensor_size; i++) {
+        if (ctx->gate_output_index >= 0 &&
+            i % batch_output_size != ctx->gate_output_index) {
+            continue;
+        }
+
+        if (gate_output[i] > ctx->gate_threshold) {
+            return FLB_TRUE;
+        }
+    }
+
+    return FLB_FALSE;
+}
+
+/* pack the output values, or only the output_size highest ones with their indexes */
+static void pack_output(struct flb_tensorflow *ctx, msgpack_packer *pck,
+                        float *output, int size)
+{
+    int i;
+    int n;
+    char idx_str[5];
+
+    /* the ids and scores of the closest references replace the embedding */
+    if (ctx->similarity) {
+        n = flb_tf_similarity_search(ctx->similarity, output);
+
+        msgpack_pack_array(pck, n);
+        for (i = 0; i < n; i++) {
+            msgpack_pack_map(pck, 2);
+            msgpack_pack_str_with_body(pck, "id", 2);
+            msgpack_pack_int(pck, ctx->similarity->top_ids[i]);
+            msgpack_pack_str_with_body(pck, "score", 5);
+            msgpack_pack_float(pck, ctx->similarity->top_scores[i]);
+        }
+        return;
+    }
+
+    if (ctx->output_size) {
+        max_output_ordering_float(ctx, output, size);
+
+        msgpack_pack_map(pck, ctx->output_size);
+
+        for (i = 0; i < ctx->output_size; i++) {
+            /* TODO: do we need to separate float16 and float32? */
+
+            sprintf(idx_str, "%d", i + 1);
+            msgpack_pack_str_with_body(pck, idx_str, strlen(idx_str));
+
+            msgpack_pack_map(pck, 2);
+
+            // actual output index
+            msgpack_pack_str_with_body(pck, "idx", 3);
+            msgpack_pack_int64(pck, ((int*) ctx->out_ordering_buffer.ordered_output_idx)[i]);
+
+            msgpack_pack_str_with_body(pck, "value", 5);
+            msgpack_pack_float(pck, ((float*) ctx->out_ordering_buffer.ordered_output)[i]);
+        }
+    }
+    else {
+        msgpack_pack_array(pck, size);
+
+        for (i = 0; i < size; i++) {
+            msgpack_pack_float(pck, output[i]);
+        }
+    }
+}
+
+/*
+ * window mode: a record holding the per-class statistics of the window,
+ * stamped with its last record
+ */
+static void pack_window(struct flb_tensorflow *ctx, msgpack_packer *pck,
+                        struct flb_tf_tag_state *s)
+{
+    int i;
+    int count;
+    double duration;
+    char idx_str[12];
+    struct flb_tf_temporal *t = ctx->temporal;
+    int *ordered_idx;
+
+    count = s->count;
+    duration = (s->end.tm.tv_sec - s->start.tm.tv_sec) +
+               (s->end.tm.tv_nsec - s->start.tm.tv_nsec) / 1e9;
+    flb_tf_temporal_window_mean(t, s);
+
+    msgpack_pack_array(pck, 2);
+    flb_time_append_to_msgpack(&s->end, pck, 0);
+
+    msgpack_pack_map(pck, ctx->output_size ? 3 : 4);
+    msgpack_pack_str_with_body(pck, "records", 7);
+    msgpack_pack_int(pck, count);
+    msgpack_pack_str_with_body(pck, "duration", 8);
+    msgpack_pack_float(pck, duration);
+
+    if (!ctx->output_size) {
+        msgpack_pack_str_with_body(pck, "mean", 4);
+        msgpack_pack_array(pck, t->classes);
+        for (i = 0; i < t->classes; i++) {
+            msgpack_pack_float(pck, t->mean[i]);
+        }
+
+        msgpack_pack_str_with_body(pck, "max", 3);
+        msgpack_pack_array(pck, t->classes);
+        for (i = 0; i < t->classes; i++) {
+            msgpack_pack_float(pck, s->max[i]);
+        }
+        return;
+    }
+
+    /* the output_size classes of the highest mean */
+    max_output_ordering_float(ctx, t->mean, t->classes);
+    ordered_idx = ctx->out_ordering_buffer.ordered_output_idx;
+
+    msgpack_pack_str_with_body(pck, "output", 6);
+    msgpack_pack_map(pck, ctx->output_size);
+    for (i = 0; i < ctx->output_size; i++) {
+        sprintf(idx_str, "%d", i + 1);
+        msgpack_pack_str_with_body(pck, idx_str, strlen(idx_str));
+
+        msgpack_pack_map(pck, 3);
+        msgpack_pack_str_with_body(pck, "idx", 3);
+        msgpack_pack_int(pck, ordered_idx[i]);
+        msgpack_pack_str_with_body(pck, "mean", 4);
+        msgpack_pack_float(pck, t->mean[ordered_idx[i]]);
+        msgpack_pack_str_with_body(pck, "max", 3);
+        msgpack_pack_float(pck, s->max[ordered_idx[i]]);
+    }
+}
+
+static void pack_label(msgpack_packer *pck, int label)
+{
+    if (label < 0) {
+        msgpack_pack_nil(pck);
+    }
+    else {
+        msgpack_pack_int(pck, label);
+    }
+}
+
+/*
+ * columnar mode: add the output of the record as a row of the batch. The id
+ * of the row is the value of record_id_field (scalars only, nil otherwise),
+ * or the position of the record in the chunk.
+ */
+static void batch_add(struct flb_tensorflow *ctx, struct flb_time *tm,
+                      msgpack_object map, int record_idx)
+{
+    int i;
+    int row = ctx->batch_rows;
+    msgpack_object key;
+    msgpack_object val;
+    msgpack_object *id = &ctx->batch_ids[row];
+
+    if (row == 0) {
+        ctx->batch_time = *tm;
+    }
+    ctx->batch_timestamps[row] = flb_time_to_double(tm);
+
+    id->type = MSGPACK_OBJECT_POSITIVE_INTEGER;
+    id->via.u64 = record_idx;
+
+    if (ctx->record_id_field) {
+        id->type = MSGPACK_OBJECT_NIL;
+
+        for (i = 0; i < map.via.map.size; i++) {
+            key = map.via.map.ptr[i].key;
+            val = map.via.map.ptr[i].val;
+
+            if (key.type != MSGPACK_OBJECT_STR ||
+                flb_sds_cmp(ctx->record_id_field, key.via.str.ptr, key.via.str.size) != 0) {
+                continue;
+            }
+
+            /* strings point into the chunk, which outlives the batch */
+            if (MSGPACK_NUMBER(val.type) || val.type == MSGPACK_OBJECT_STR ||
+                val.type == MSGPACK_OBJECT_BOOLEAN) {
+                *id = val;
+            }
+            break;
+        }
+    }
+
+    memcpy(ctx->batch_output + row * ctx->model->output_byte_size,
+           ctx->model->output, ctx->model->output_byte_size);
+    ctx->batch_rows++;
+}
+
+/*
+ * columnar mode: emit the batch as a single record, stamped with its first
+ * row. The output matrix is packed as one binary of rows x columns float32
+ * values, row by row.
+ */
+static void pack_batch(struct flb_tensorflow *ctx, msgpack_packer *pck)
+{
+    int i;
+    int rows = ctx->batch_rows;
+
+    if (rows == 0) {
+        return;
+    }
+
+    msgpack_pack_array(pck, 2);
+    flb_time_append_to_msgpack(&ctx->batch_time, pck, 0);
+
+    msgpack_pack_map(pck, 4);
+
+    msgpack_pack_str_with_body(pck, "timestamps", 10);
+    msgpack_pack_array(pck, rows);
+    for (i = 0; i < rows; i++) {
+        msgpack_pack_double(pck, ctx->batch_timestamps[i]);
+    }
+
+    msgpack_pack_str_with_body(pck, "ids", 3);
+    msgpack_pack_array(pck, rows);
+    for (i = 0; i < rows; i++) {
+        msgpack_pack_object(pck, ctx->batch_ids[i]);
+    }
+
+    msgpack_pack_str_with_body(pck, "shape", 5);
+    msgpack_pack_array(pck, 2);
+    msgpack_pack_int(pck, rows);
+    msgpack_pack_int(pck, ctx->model->output_tensor_size);
+
+    msgpack_pack_str_with_body(pck, "output", 6);
+    msgpack_pack_bin_with_body(pck, ctx->batch_output, rows * ctx->model->output_byte_size);
+
+    ctx->batch_rows = 0;
+}
+
+static int parse_input_encoding(const char *str)
+{
+    if (strcasecmp(str, "u8") == 0) {
+        return INPUT_ENCODING_U8;
+    }
+    else if (strcasecmp(str, "i8") == 0) {
+        return INPUT_ENCODING_I8;
+    }
+    else if (strcasecmp(str, "u16") == 0) {
+        return INPUT_ENCODING_U16;
+    }
+    else if (strcasecmp(str, "f16") == 0) {
+        return INPUT_ENCODING_F16;
+    }
+    else if (strcasecmp(str, "f32") == 0) {
+        return INPUT_ENCODING_F32;
+    }
+    else if (strcasecmp(str, "i32") == 0) {
+        return INPUT_ENCODING_I32;
+    }
+
+    return -1;
+}
+
+/*
+ * output_size can't exceed the number of outputs of a record, i.e. of a
+ * tile for tiled inference
+ */
+static int check_output_size(struct flb_tensorflow *ctx, struct flb_tf_model *m)
+{
+    int record_output_size = m->output_tensor_size / m->batch_size;
+
+    if (ctx->output_size > record_output_size) {
+        flb_plg_error(ctx->ins, "output_size (%d) exceeds the %d outputs of model %s!",
+                      ctx->output_size, record_output_size, m->path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the model of a file, loaded the first time a route references it */
+static struct flb_tf_model *get_model(struct flb_tensorflow *ctx, const char *path)
+{
+    int i;
+    struct flb_tf_model *m;
+
+    if (ctx->model && strcmp(ctx->model->path, path) == 0) {
+        return ctx->model;
+    }
+
+    for (i = 0; i < ctx->model_count; i++) {
+        if (strcmp(ctx->models[i]->path, path) == 0) {
+            return ctx->models[i];
+        }
+    }
+
+    m = flb_tf_model_create(ctx, path);
+    if (m) {
+        ctx->models[ctx->model_count++] = m;
+    }
+
+    return m;
+}
+
+/*
+ * routes are set as
+ *   route <tag_pattern> <model_file> [normalization_value] [input_encoding]
+ * and inherit the preprocessing settings of the instance they don't set
+ */
+static int load_routes(struct flb_tensorflow *ctx)
+{
+    int n;
+    int encoding;
+    struct mk_list *head;
+    struct flb_config_map_val *mv;
+    struct flb_slist_entry *e;
+    struct flb_tf_route *r;
+
+    if (!ctx->route_list) {
+        return 0;
+    }
+
+    flb_config_map_foreach(head, mv, ctx->route_list) {
+        n = mk_list_size(mv->val.list);
+        if (n < 2) {
+            flb_plg_error(ctx->ins, "route must be set as <tag_pattern> <model_file> "
+                          "[normalization_value] [input_encoding]!");
+            return -1;
+        }
+
+        if (ctx->route_count == FLB_TF_ROUTES) {
+            flb_plg_error(ctx->ins, "too many routes (max %d)!", FLB_TF_ROUTES);
+            return -1;
+        }
+
+        r = &ctx->routes[ctx->route_count];
+        e = flb_slist_entry_get(mv->val.list, 0);
+        r->match = flb_sds_create(e->str);
+        r->pre = ctx->pre;
+        ctx->route_count++;
+
+        e = flb_slist_entry_get(mv->val.list, 1);
+        r->model = get_model(ctx, e->str);
+        if (!r->model) {
+            return -1;
+        }
+
+        if (n > 2) {
+            e = flb_slist_entry_get(mv->val.list, 2);
+            r->normalization_value = atof(e->str);
+            r->pre.normalization_value = &r->normalization_value;
+        }
+
+        if (n > 3) {
+            e = flb_slist_entry_get(mv->val.list, 3);
+            encoding = parse_input_encoding(e->str);
+            if (encoding == -1) {
+                flb_plg_error(ctx->ins, "route input_encoding must be u8, i8, u16, f16, f32 or i32!");
+                return -1;
+            }
+            r->pre.input_encoding = encoding;
+        }
+
+        flb_plg_info(ctx->ins, "route %s: %s", r->match, r->model->path);
+    }
+
+    return 0;
+}
+
+/* the first route matching the tag, if any */
+static struct flb_tf_route *get_route(struct flb_tensorflow *ctx,
+                                      const char *tag, int tag_len)
+{
+    int i;
+
+    for (i = 0; i < ctx->route_count; i++) {
+        if (flb_router_match(tag, tag_len, ctx->routes[i].match, NULL)) {
+            return &ctx->routes[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int cb_tensorflow_init(struct flb_filter_instance *f_ins,
+                              struct flb_config *config,
+                              void *data)
+{
+    int i;
+    int ret;
+    int metric_id;
+    struct flb_tensorflow *ctx = NULL;
+    const char *tmp;
+    const char *metric;
+
+    ctx = flb_calloc(1, sizeof(struct flb_tensorflow));
+    if (!ctx) {
+        flb_errno();
+        return -1;
+    }
+
+    ret = flb_filter_config_map_set(f_ins, (void *) ctx);
+    if (ret == -1) {
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    ctx->ins = f_ins;
+
+    tmp = flb_filter_get_property("input_field", f_ins);
+    if (!tmp) {
+        flb_plg_error(ctx->ins, "input field is not defined!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    ctx->input_field = flb_sds_create(tmp);
+
+    tmp = flb_filter_get_property("device", f_ins);
+    if (!tmp) {
+        flb_plg_error(ctx->ins, "device field is not defined!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    if (strcasecmp(tmp, "cpu") == 0) {
+        ctx->device = DEVICE_CPU;
+    }
+    else if (strcasecmp(tmp, "gpu") == 0) {
+        ctx->device = DEVICE_GPU;
+    }
+    else {
+        flb_plg_error(ctx->ins, "device field must be \"cpu\" or \"gpu\"!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    tmp = flb_filter_get_property("trace_file", f_ins);
+    if (tmp) {
+        ctx->trace = trace_create(tmp, flb_filter_name(f_ins), ctx->trace_flush_ms);
+        if (!ctx->trace) {
+            flb_errno();
+            flb_plg_error(ctx->ins, "could not open trace_file %s!", tmp);
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+    }
+
+    tmp = thread_placement_parse(&ctx->inference_placement,
+                                 flb_filter_get_property("inference_cpus", f_ins),
+                                 flb_filter_get_property("inference_sched_policy", f_ins),
+                                 ctx->inference_sched_priority);
+    if (tmp) {
+        flb_plg_error(ctx->ins, "inference thread placement: %s!", tmp);
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    tmp = flb_filter_get_property("input_encoding", f_ins);
+    ctx->pre.input_encoding = tmp ? parse_input_encoding(tmp) : INPUT_ENCODING_U8;
+    if (ctx->pre.input_encoding == -1) {
+        flb_plg_error(ctx->ins, "input_encoding must be u8, i8, u16, f16, f32 or i32!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    tmp = flb_filter_get_property("input_endianness", f_ins);
+    if (!tmp || strcasecmp(tmp, "little") == 0) {
+        ctx->pre.input_big_endian = FLB_FALSE;
+    }
+    else if (strcasecmp(tmp, "big") == 0) {
+        ctx->pre.input_big_endian = FLB_TRUE;
+    }
+    else {
+        flb_plg_error(ctx->ins, "input_endianness must be \"little\" or \"big\"!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    /* tiles are cut from frames of one byte per color */
+    if (ctx->tile_frame_width > 0 && ctx->pre.input_encoding != INPUT_ENCODING_U8) {
+        flb_plg_error(ctx->ins, "tiled inference requires u8 input_encoding!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    /* model_file is optional with routes: records of other tags are left untouched */
+    tmp = flb_filter_get_property("model_file", f_ins);
+    if (!tmp && !ctx->route_list) {
+        flb_plg_error(ctx->ins, "TensorFlow Lite model file is not provided!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    if (tmp) {
+        ctx->model = flb_tf_model_create(ctx, tmp);
+        if (!ctx->model) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+    }
+
+    /*
+     * routed models have their own input and output shapes: the features
+     * tied to the shapes of model_file can't be used with routes
+     */
+    if (ctx->route_list) {
+        tmp = flb_filter_get_property("output_mode", f_ins);
+        if (flb_filter_get_property("gate_model_file", f_ins) ||
+            flb_filter_get_property("reference_file", f_ins) ||
+            ctx->tile_frame_width > 0 || (tmp && strcasecmp(tmp, "record") != 0)) {
+            flb_plg_error(ctx->ins, "routes can't be used with a gate model, tiles, "
+                          "similarity search or output modes other than record!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+    }
+
+    tmp = flb_filter_get_property("gate_model_file", f_ins);
+    if (tmp) {
+        ctx->gate = flb_tf_model_create(ctx, tmp);
+        if (!ctx->gate) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        /* both models are fed from the same preprocessed input buffer */
+        if (ctx->gate->input_tensor_type != ctx->model->input_tensor_type ||
+            ctx->gate->input_byte_size != ctx->model->input_byte_size) {
+            flb_plg_error(ctx->ins, "gate model input doesn't match the input of the main model!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
 
-    tmp = flb_filter_get_property("model_file", f_ins);
-    if (!tmp) {
-        flb_plg_error(ctx->ins, "TensorFlow Lite model file is not provided!");
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
-    }
+        if (ctx->gate->output_tensor_type != kTfLiteFloat32) {
+            flb_plg_error(ctx->ins, "gate model output has to be of float32 type!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
 
-    if(access(tmp, F_OK) == -1) {
-        flb_plg_error(ctx->ins, "TensorFlow Lite model file %s not found!", tmp);
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+        if (ctx->gate_output_index >= ctx->gate->output_tensor_size / ctx->gate->batch_size) {
+            flb_plg_error(ctx->ins, "gate_output_index (%d) is out of the gate model output range!",
+                          ctx->gate_output_index);
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
     }
 
-    build_interpreter(ctx, (char *) tmp);
+    tmp = flb_filter_get_property("reference_file", f_ins);
+    if (tmp) {
+        if (ctx->model->output_tensor_type != kTfLiteFloat32) {
+            flb_plg_error(ctx->ins, "similarity search requires a float32 model output!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
 
-    if (!ctx->interpreter) {
-        flb_plg_error(ctx->ins, "Error creating the interpreter");
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
-    }
+        metric = flb_filter_get_property("similarity_metric", f_ins);
+        if (!metric || strcasecmp(metric, "cosine") == 0) {
+            metric_id = SIMILARITY_COSINE;
+        }
+        else if (strcasecmp(metric, "dot") == 0) {
+            metric_id = SIMILARITY_DOT;
+        }
+        else {
+            flb_plg_error(ctx->ins, "similarity_metric must be \"cosine\" or \"dot\"!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
 
-    /* calculate input information */
-    ctx->input_tensor_size = 1;
-    tensor = TfLiteInterpreterGetInputTensor(ctx->interpreter, 0);
-    for (i = 0; i < TfLiteTensorNumDims(tensor); i++) {
-        ctx->input_tensor_size *= TfLiteTensorDim(tensor, i);
-    }
-    ctx->input_tensor_type = TfLiteTensorType(tensor);
-    if (allocateIOBuffer(ctx, &ctx->input, ctx->input_tensor_type, ctx->input_tensor_size) == -1) {
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
-    }
-    ctx->input_byte_size = TfLiteTensorByteSize(tensor);
+        if (ctx->similarity_top_k < 1) {
+            flb_plg_error(ctx->ins, "similarity_top_k has to be an integer >= 1!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
 
-    /* calculate output information */
-    ctx->output_tensor_size = 1;
-    tensor = TfLiteInterpreterGetOutputTensor(ctx->interpreter, 0);
-    for (i = 0; i < TfLiteTensorNumDims(tensor); i++) {
-        ctx->output_tensor_size *= TfLiteTensorDim(tensor, i);
-    }
-    ctx->output_tensor_type = TfLiteTensorType(tensor);
-    if (allocateIOBuffer(ctx, &ctx->output, ctx->output_tensor_type, ctx->output_tensor_size) == -1) {
-        flb_tensorflow_conf_destroy(ctx);
-        return -1;
+        ctx->similarity = flb_tf_similarity_create(ctx->ins, tmp,
+                                                   ctx->model->output_tensor_size /
+                                                   ctx->model->batch_size,
+                                                   metric_id, ctx->similarity_top_k,
+                                                   ctx->ivf_lists, ctx->ivf_probes);
+        if (!ctx->similarity) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
     }
-    ctx->output_byte_size = TfLiteTensorByteSize(tensor);
 
     tmp = flb_filter_get_property("include_input_fields", f_ins);
     if (!tmp) {
@@ -298,14 +1711,34 @@ static int cb_tensorflow_init(struct flb_filter_instance *f_ins,
 
     tmp = flb_filter_get_property("normalization_value", f_ins);
     if (tmp) {
-        ctx->normalization_value = flb_malloc(sizeof(float));
-        *ctx->normalization_value = atof(tmp);
+        ctx->pre.normalization_value = flb_malloc(sizeof(float));
+        *ctx->pre.normalization_value = atof(tmp);
+    }
+
+    /* routes inherit the preprocessing settings of the instance */
+    if (ctx->route_list) {
+        if (load_routes(ctx) == -1) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
     }
 
     tmp = flb_filter_get_property("output_size", f_ins);
     if (tmp) {
-        /* tensor type: kTfLiteFloat32 */
-        if (ctx->output_tensor_type == kTfLiteFloat32) {
+        if (ctx->model && check_output_size(ctx, ctx->model) == -1) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        for (i = 0; i < ctx->model_count; i++) {
+            if (check_output_size(ctx, ctx->models[i]) == -1) {
+                flb_tensorflow_conf_destroy(ctx);
+                return -1;
+            }
+        }
+
+        /* tensor type: kTfLiteFloat32 (the only output type of routed models) */
+        if (!ctx->model || ctx->model->output_tensor_type == kTfLiteFloat32) {
             ctx->out_ordering_buffer.ordered_output = (void *) flb_malloc(ctx->output_size * sizeof(float));
             if (!ctx->out_ordering_buffer.ordered_output) {
                 flb_tensorflow_conf_destroy(ctx);
@@ -320,6 +1753,104 @@ static int cb_tensorflow_init(struct flb_filter_instance *f_ins,
         }
     }
 
+    tmp = flb_filter_get_property("output_mode", f_ins);
+    if (!tmp || strcasecmp(tmp, "record") == 0) {
+        ctx->output_mode = OUTPUT_MODE_RECORD;
+    }
+    else if (strcasecmp(tmp, "window") == 0) {
+        ctx->output_mode = OUTPUT_MODE_WINDOW;
+    }
+    else if (strcasecmp(tmp, "transition") == 0) {
+        ctx->output_mode = OUTPUT_MODE_TRANSITION;
+    }
+    else if (strcasecmp(tmp, "columnar") == 0) {
+        ctx->output_mode = OUTPUT_MODE_COLUMNAR;
+    }
+    else {
+        flb_plg_error(ctx->ins, "output_mode must be \"record\", \"window\", "
+                      "\"transition\" or \"columnar\"!");
+        flb_tensorflow_conf_destroy(ctx);
+        return -1;
+    }
+
+    if (ctx->output_mode == OUTPUT_MODE_COLUMNAR) {
+        /* rows are the raw model outputs */
+        if (ctx->similarity || ctx->output_size) {
+            flb_plg_error(ctx->ins, "columnar output mode can't be used with output_size "
+                          "or similarity search!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        if (ctx->batch_records < 1) {
+            flb_plg_error(ctx->ins, "batch_records has to be an integer >= 1!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        tmp = flb_filter_get_property("record_id_field", f_ins);
+        if (tmp) {
+            ctx->record_id_field = flb_sds_create(tmp);
+        }
+
+        ctx->batch_timestamps = flb_malloc(ctx->batch_records * sizeof(double));
+        ctx->batch_ids = flb_malloc(ctx->batch_records * sizeof(msgpack_object));
+        ctx->batch_output = flb_malloc((size_t) ctx->batch_records *
+                                       ctx->model->output_byte_size);
+        if (!ctx->batch_timestamps || !ctx->batch_ids || !ctx->batch_output) {
+            flb_errno();
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+    }
+    else if (ctx->output_mode != OUTPUT_MODE_RECORD) {
+        if (ctx->tile_count || ctx->similarity ||
+            ctx->model->output_tensor_type != kTfLiteFloat32) {
+            flb_plg_error(ctx->ins, "window and transition output modes require a float32 "
+                          "model output, without tiles or similarity search!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        if (ctx->output_mode == OUTPUT_MODE_WINDOW &&
+            ctx->window_records <= 0 && ctx->window_ms <= 0) {
+            flb_plg_error(ctx->ins, "window output mode requires window_records or window_ms!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        if (ctx->transition_low > ctx->transition_high) {
+            flb_plg_error(ctx->ins, "transition_low has to be <= transition_high!");
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+
+        ctx->temporal = flb_tf_temporal_create(ctx->output_mode, ctx->model->output_tensor_size,
+                                               ctx->window_records, ctx->window_ms,
+                                               ctx->transition_high, ctx->transition_low);
+        if (!ctx->temporal) {
+            flb_tensorflow_conf_destroy(ctx);
+            return -1;
+        }
+    }
+
+    ctx->cmt_stale_records = cmt_counter_create(f_ins->cmt, "fluentbit", "filter",
+                                                "tensorflow_stale_records_total",
+                                                "Records skipped for being older than max_age_ms.",
+                                                1, (char *[]) {"name"});
+    ctx->cmt_shed_records = cmt_counter_create(f_ins->cmt, "fluentbit", "filter",
+                                               "tensorflow_shed_records_total",
+                                               "Records skipped while over the latency budget.",
+                                               1, (char *[]) {"name"});
+    ctx->cmt_timeout_records = cmt_counter_create(f_ins->cmt, "fluentbit", "filter",
+                                                  "tensorflow_timeout_records_total",
+                                                  "Records whose invoke has been cancelled after max_invoke_ms.",
+                                                  1, (char *[]) {"name"});
+    ctx->cmt_overwritten_records = cmt_counter_create(f_ins->cmt, "fluentbit", "filter",
+                                                      "tensorflow_overwritten_records_total",
+                                                      "Records whose frame has been overwritten in its frame ring.",
+                                                      1, (char *[]) {"name"});
+
     flb_filter_set_context(f_ins, ctx);
     return 0;
 }
@@ -335,13 +1866,30 @@ static int cb_tensorflow_filter(const void *data, size_t bytes,
     size_t off = 0;
     int i;
     int j;
-    int input_data_type;
     (void) out_buf;
     (void) out_bytes;
     (void) f_ins;
     (void) i_ins;
     int map_size;
-    char idx_str[5];
+    int out_map_size;
+    int ret;
+    int run_model;
+    int tile_output_size;
+    int transition;
+    int previous_label;
+    int record_idx;
+    const char *skip_reason;
+    struct flb_tf_route *route;
+    struct flb_tf_preprocess *pre;
+    uint64_t span_start = 0;
+    uint64_t seq = 0;
+    int traced = FLB_FALSE;
+    struct flb_tf_tag_state *state;
+    uint32_t ring_slot;
+    uint64_t ring_seq;
+    struct frame_ring *ring;
+    size_t record_offset;
+    int frame_copied;
 
     msgpack_object root;
     msgpack_object map;
@@ -355,28 +1903,43 @@ static int cb_tensorflow_filter(const void *data, size_t bytes,
     msgpack_packer tmp_pck;
 
     struct flb_tensorflow* ctx;
-
-    /* data pointers */
-    unsigned char* dchar;
-    int* dint;
-    float* dfloat;
+    struct flb_tf_model* model;
 
     /* calculate inference time */
-    clock_t start, end;
+    clock_t start;
+    double invoke_start;
     double inference_time;
     double input_packing_time;
     double output_packing_time;
 
     /* initializations */
     ctx = filter_context;
+    model = ctx->model;
+    pre = &ctx->pre;
+
+    route = get_route(ctx, tag, tag_len);
+    if (route) {
+        model = route->model;
+        pre = &route->pre;
+    }
+
+    /* no route nor model_file for this tag */
+    if (!model) {
+        return FLB_FILTER_NOTOUCH;
+    }
     inference_time = 0;
     input_packing_time = 0;
     output_packing_time = 0;
+    record_idx = 0;
     start = clock();
 
     msgpack_sbuffer_init(&tmp_sbuf);
     msgpack_packer_init(&tmp_pck, &tmp_sbuf, msgpack_sbuffer_write);
 
+    if (ctx->trace) {
+        span_start = trace_now();
+    }
+
     msgpack_unpacked_init(&result);
     while (msgpack_unpack_next(&result, data, bytes, &off) == MSGPACK_UNPACK_SUCCESS) {
         root = result.data;
@@ -388,6 +1951,9 @@ static int cb_tensorflow_filter(const void *data, size_t bytes,
         /* get timestamp from msgpack record */
         flb_time_pop_from_msgpack(&tm, &result, &obj);
 
+        record_offset = tmp_sbuf.size;
+        frame_copied = FLB_FALSE;
+
         for (i = 0; i < map_size; i++) {
             key = map.via.map.ptr[i].key;
 
@@ -395,133 +1961,157 @@ static int cb_tensorflow_filter(const void *data, size_t bytes,
                 continue;
             }
 
-            /* Convention: value has to be of primitive types, or array of
-             * primitive types i.e. unrolled data (like unrolled image)
-             */
             value = map.via.map.ptr[i].val;
-            if (value.type == MSGPACK_OBJECT_ARRAY)
-            {
-                int size = value.via.array.size;
-                if (size == 0) {
-                    flb_plg_error(ctx->ins, "input data size has to be non-zero!");
-                    break;
-                }
 
-                if (size != ctx->input_tensor_size) {
-                    flb_plg_error(ctx->ins, "input data size doesn't match model's input size!");
+            /* spans: unpacking the record and finding its input field */
+            if (ctx->trace) {
+                seq = record_seq(map, record_idx);
+                trace_span(ctx->trace, "filter", "parse", span_start, seq);
+                span_start = trace_now();
+                traced = FLB_TRUE;
+            }
+
+            ring = NULL;
+            if (value.type == MSGPACK_OBJECT_MAP) {
+                ret = resolve_frame_reference(ctx, value, &value, &ring, &ring_slot, &ring_seq);
+                if (ret == 1) {
+                    record_overwritten(ctx);
+                    pack_skipped_record(ctx, &tmp_pck, &tm, map, i, NULL, "overwritten");
                     break;
                 }
-
-                /* we only accept numbers inside input array */
-                input_data_type = value.via.array.ptr[0].type;
-                if (!MSGPACK_NUMBER(input_data_type)) {
-                    flb_plg_error(ctx->ins, "input data has to be of numerical type!");
+                else if (ret == -1) {
                     break;
                 }
+            }
 
-                /* copy data from messagepack into the input buffer */
-                /* tensor type: kTfLiteFloat32 */
-                if (ctx->input_tensor_type == kTfLiteFloat32) {
-                    /* (stackoverflow) in most implementations:
-                     *  float is the IEEE754 single precision type which is 32 bits.
-                     *  double is the IEEE754 64-bit double precision type
-                     */
-                    if (sizeof(float) != sizeof(kTfLiteFloat32)) {
-                        flb_plg_error(ctx->ins, "input tensor type (kTfLiteFloat32) doesn't match float size!");
-                        break;
-                    }
+            skip_reason = admission_control(ctx, model, &tm);
+            if (skip_reason) {
+                pack_skipped_record(ctx, &tmp_pck, &tm, map, i, &value, skip_reason);
+                frame_copied = (ring != NULL);
+                break;
+            }
 
-                    dfloat = (float *) ctx->input;
+            if (ctx->tile_count) {
+                ret = load_tiled_input(ctx, model, value);
+            }
+            else {
+                ret = load_input(ctx, model, pre, value);
+            }
 
-                    if (MSGPACK_FLOAT(input_data_type)) {
-                        for (i = 0; i < value.via.array.size; i++) {
-                            dfloat[i] = value.via.array.ptr[i].via.f64;
+            if (ret == -1) {
+                break;
+            }
 
-                        }
-                    }
-                    else if (MSGPACK_INTEGER(input_data_type)) {
-                        for (i = 0; i < value.via.array.size; i++) {
-                            dfloat[i] = ((float) value.via.array.ptr[i].via.i64);
-                        }
-                    }
-                    else {
-                        flb_plg_error(ctx->ins, "input record type is not supported for a float32 input tensor!");
-                        break;
+            /* the capture thread may have reused the ring slot while it was read */
+            if (ring && !frame_ring_valid(ring, ring_slot, ring_seq)) {
+                record_overwritten(ctx);
+                pack_skipped_record(ctx, &tmp_pck, &tm, map, i, NULL, "overwritten");
+                break;
+            }
+
+            if (ctx->trace) {
+                trace_span(ctx->trace, "filter", "preprocess", span_start, seq);
+                span_start = trace_now();
+            }
+
+            /*
+             * run the inference: the gate model (if any) sees every record,
+             * the main model only the ones the gate lets through
+             */
+            invoke_start = monotonic_ms();
+            run_model = FLB_TRUE;
+            ret = 0;
+            if (ctx->gate) {
+                ret = model_invoke(ctx, ctx->gate, model->input);
+                run_model = (ret == 0 && gate_passed(ctx));
+            }
+
+            if (ret == 0 && run_model) {
+                ret = model_invoke(ctx, model, model->input);
+            }
+
+            model->invoke_latency_ewma += INVOKE_LATENCY_EWMA_ALPHA *
+                ((monotonic_ms() - invoke_start) - model->invoke_latency_ewma);
+
+            if (ctx->trace) {
+                trace_span(ctx->trace, "filter", "invoke", span_start, seq);
+                span_start = trace_now();
+            }
+
+            if (ret == 1) {
+                pack_skipped_record(ctx, &tmp_pck, &tm, map, i, &value, "timeout");
+                frame_copied = (ring != NULL);
+                break;
+            }
+            else if (ret == -1) {
+                break;
+            }
+
+            /*
+             * window mode: the output is added to the window of the tag, and
+             * only complete windows are emitted. Transition mode: the record is
+             * only emitted if the label of the tag changes.
+             */
+            transition = FLB_FALSE;
+            if (ctx->temporal) {
+                state = flb_tf_temporal_state(ctx->temporal, tag, tag_len);
+
+                if (ctx->output_mode == OUTPUT_MODE_WINDOW) {
+                    /* a record past the window closes it, and starts the next one */
+                    if (flb_tf_temporal_window_expired(ctx->temporal, state, &tm)) {
+                        pack_window(ctx, &tmp_pck, state);
                     }
-                    /* TODO: can we set normalization_value = 1.0 and always perform the devide operation?
-                     * How does it affect the performance?
-                     */
-                    if (ctx->normalization_value) {
-                        for (i = 0; i < value.via.array.size; i++) {
-                            dfloat[i] /= *ctx->normalization_value;
-                        }
+                    if (run_model &&
+                        flb_tf_temporal_window_add(ctx->temporal, state,
+                                                   (float *) model->output, &tm)) {
+                        pack_window(ctx, &tmp_pck, state);
                     }
+                    break;
                 }
-                else {
-                    flb_plg_error(ctx->ins, "input tensor type is not currently not supported!");
+
+                if (!flb_tf_temporal_transition(ctx->temporal, state,
+                                                run_model ? (float *) model->output : NULL,
+                                                &previous_label)) {
                     break;
                 }
+                transition = FLB_TRUE;
             }
-            else if (value.type == MSGPACK_OBJECT_BIN) {
-                /* important: in the case of binary, we need to know how the data is serialized.
-                 * for instance, images can be encoded with one character per color, or 4 bytes (float32)
-                 * if it is already scaled between 0 and 1
-                 */
-                 if (ctx->input_tensor_type == kTfLiteFloat32) {
-                     dfloat = (float *) ctx->input;
-
-                     /*
-                      * re:IEEE754 float size is 32 bits
-                      * TODO: currently, the following assumes that the binrary
-                      * string is the serialization of a string of characters (uint8_t).
-                      * It is required to add other primitive data type encodings such as
-                      * floating point numbers.
-                      */
-                     if (ctx->input_byte_size != (value.via.bin.size << 2)) {
-                       flb_plg_error(ctx->ins, "input data size (%d bytes * 4) doesn't"
-                                 "match model's input size (%d bytes)!",
-                                 value.via.bin.size, ctx->input_byte_size);
-                       break;
-                     }
-
-                     for (i = 0; i < value.via.bin.size; i++) {
-                         dfloat[i] = ((float) value.via.bin.ptr[i]);
-                     }
-
-                     if (ctx->normalization_value) {
-                         for (i = 0; i < value.via.bin.size; i++) {
-                             dfloat[i] /= *ctx->normalization_value;
-                         }
-                     }
+
+            /* columnar mode: the output becomes a row of the batch */
+            if (ctx->output_mode == OUTPUT_MODE_COLUMNAR && run_model) {
+                batch_add(ctx, &tm, map, record_idx);
+                if (ctx->batch_rows == ctx->batch_records) {
+                    pack_batch(ctx, &tmp_pck);
                 }
-            }
-            else {
-                flb_plg_error(ctx->ins, "input data format is not currently supported!");
                 break;
             }
 
-            /* run the inference */
-            inference(ctx->interpreter, ctx->input, ctx->output, ctx->input_byte_size, ctx->output_byte_size);
-
             /* create output messagepack */
             inference_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
             start = clock();
 
             msgpack_pack_array(&tmp_pck, 2);
             flb_time_append_to_msgpack(&tm, &tmp_pck, 0);
-            /* one more field for the result */
-            if (ctx->include_input_fields) {
-                msgpack_pack_map(&tmp_pck, map_size + 2);
+
+            /* one more field for the inference time, and one per model output */
+            out_map_size = 1;
+            if (run_model) {
+                out_map_size++;
             }
-            else {
-                msgpack_pack_map(&tmp_pck, 2);
+            if (ctx->gate) {
+                out_map_size++;
+            }
+            if (transition) {
+                out_map_size += 2;
+            }
+            if (ctx->include_input_fields) {
+                out_map_size += map_size;
             }
+            msgpack_pack_map(&tmp_pck, out_map_size);
 
             if (ctx->include_input_fields) {
-                for (j = 0; j < map_size; j++) {
-                    msgpack_pack_object(&tmp_pck, map.via.map.ptr[j].key);
-                    msgpack_pack_object(&tmp_pck, map.via.map.ptr[j].val);
-                }
+                pack_input_fields(&tmp_pck, map, i, &value);
+                frame_copied = (ring != NULL);
 
                 input_packing_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
                 start = clock();
@@ -531,64 +2121,102 @@ static int cb_tensorflow_filter(const void *data, size_t bytes,
             msgpack_pack_str_body(&tmp_pck, "inference_time", strlen("inference_time"));
             msgpack_pack_float(&tmp_pck, inference_time);
 
-            msgpack_pack_str(&tmp_pck, strlen("output"));
-            msgpack_pack_str_body(&tmp_pck, "output", 6);
-
-
-            if (ctx->output_size) {
-                if (ctx->output_tensor_type == kTfLiteFloat32) {
-                    max_output_ordering_float(ctx);
-               }
-               else {
-                   /* TODO: add relevant data types */
-                   flb_plg_error(ctx->ins, "output data format is not currently supported!");
-                   break;
-               }
-
-               msgpack_pack_map(&tmp_pck, ctx->output_size);
-
-               for (i=0; i < ctx->output_size; i++) {
-                   /* TODO: do we need to separate float16 and float32? */
-
-                   sprintf(idx_str, "%d", i + 1);
-                   msgpack_pack_str_with_body(&tmp_pck, idx_str, strlen(idx_str));
+            if (ctx->gate) {
+                msgpack_pack_str_with_body(&tmp_pck, "gate_output", 11);
+                msgpack_pack_array(&tmp_pck, ctx->gate->output_tensor_size);
+                for (j = 0; j < ctx->gate->output_tensor_size; j++) {
+                    msgpack_pack_float(&tmp_pck, ((float*) ctx->gate->output)[j]);
+                }
+            }
 
-                   msgpack_pack_map(&tmp_pck, 2);
+            if (transition) {
+                msgpack_pack_str_with_body(&tmp_pck, "label", 5);
+                pack_label(&tmp_pck, state->label);
+                msgpack_pack_str_with_body(&tmp_pck, "previous_label", 14);
+                pack_label(&tmp_pck, previous_label);
+            }
 
-                   // actual output index
-                   msgpack_pack_str_with_body(&tmp_pck, "idx", 3);
-                   msgpack_pack_int64(&tmp_pck, ((int*) ctx->out_ordering_buffer.ordered_output_idx)[i]);
+            if (!run_model) {
+                output_packing_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
+                break;
+            }
 
-                   msgpack_pack_str_with_body(&tmp_pck, "value", 5);
-                   if (ctx->output_tensor_type == kTfLiteFloat32) {
-                       msgpack_pack_float(&tmp_pck, ((float*) ctx->out_ordering_buffer.ordered_output)[i]);
-                   }
-                   /* TODO: work out other types */
-               }
+            if (ctx->tile_count) {
+                msgpack_pack_str_with_body(&tmp_pck, "tiles", 5);
             }
             else {
-                msgpack_pack_array(&tmp_pck, ctx->output_tensor_size);
+                msgpack_pack_str(&tmp_pck, strlen("output"));
+                msgpack_pack_str_body(&tmp_pck, "output", 6);
+            }
 
-                for (i=0; i < ctx->output_tensor_size; i++) {
-                    if (ctx->output_tensor_type == kTfLiteFloat32) {
-                        msgpack_pack_float(&tmp_pck, ((float*) ctx->output)[i]);
-                    }
-                    /* TODO: work out other types */
+            if (ctx->tile_count) {
+                /* one result per tile, at its offset in the frame */
+                tile_output_size = model->output_tensor_size / model->batch_size;
+                msgpack_pack_array(&tmp_pck, ctx->tile_count);
+
+                for (j = 0; j < ctx->tile_count; j++) {
+                    msgpack_pack_map(&tmp_pck, 3);
+                    msgpack_pack_str_with_body(&tmp_pck, "x", 1);
+                    msgpack_pack_int(&tmp_pck, ctx->tiles[j].x);
+                    msgpack_pack_str_with_body(&tmp_pck, "y", 1);
+                    msgpack_pack_int(&tmp_pck, ctx->tiles[j].y);
+                    msgpack_pack_str_with_body(&tmp_pck, "output", 6);
+                    pack_output(ctx, &tmp_pck,
+                                ((float *) model->output) + j * tile_output_size,
+                                tile_output_size);
                 }
             }
+            else {
+                pack_output(ctx, &tmp_pck, (float *) model->output, model->output_tensor_size);
+            }
 
             output_packing_time = ((double) (clock() - start)) / CLOCKS_PER_SEC;
 
             break;
         }
+
+        /*
+         * a frame copied from its ring into the record (input fields) may
+         * have been overwritten while the model ran: the record is replaced
+         * by an overwritten skip record
+         */
+        if (frame_copied && ctx->include_input_fields &&
+            !frame_ring_valid(ring, ring_slot, ring_seq)) {
+            tmp_sbuf.size = record_offset;
+            record_overwritten(ctx);
+            pack_skipped_record(ctx, &tmp_pck, &tm, map, i, NULL, "overwritten");
+        }
+
+        /* the rest of the record: output (or skipped record) packing */
+        if (ctx->trace) {
+            if (traced) {
+                trace_span(ctx->trace, "filter", "pack", span_start, seq);
+            }
+            span_start = trace_now();
+            traced = FLB_FALSE;
+        }
+
+        record_idx++;
     }
 
+    /* batches don't span chunks */
+    pack_batch(ctx, &tmp_pck);
+
     flb_plg_debug(ctx->ins, "TensorFlow plugin processing time: "
-                            "inference: %f input field packing: %f output packing: %f ",
-                            inference_time, input_packing_time, output_packing_time);
+                            "inference: %f input field packing: %f output packing: %f "
+                            "(invoke latency avg: %.2f ms, arrival interval avg: %.2f ms, "
+                            "skipped stale: %lu overload: %lu timeout: %lu overwritten: %lu)",
+                            inference_time, input_packing_time, output_packing_time,
+                            model->invoke_latency_ewma, model->arrival_interval_ewma,
+                            ctx->stale_records, ctx->shed_records,
+                            ctx->timeout_records, ctx->overwritten_records);
 
     msgpack_unpacked_destroy(&result);
 
+    if (ctx->trace) {
+        trace_flush(ctx->trace, FLB_FALSE);
+    }
+
     *out_buf  = tmp_sbuf.data;
     *out_bytes = tmp_sbuf.size;
     return FLB_FILTER_MODIFIED;
@@ -608,6 +2236,13 @@ static struct flb_config_map config_map[] = {
         0, FLB_FALSE, 0,
         "Address of the TensorFlow Lite model file (.tflite)"
     },
+    {
+        FLB_CONFIG_MAP_SLIST_4, "route", NULL,
+        FLB_CONFIG_MAP_MULT, FLB_TRUE, offsetof(struct flb_tensorflow, route_list),
+        "Infer the records of the tags matching a pattern with their own model: "
+        "<tag_pattern> <model_file> [normalization_value] [input_encoding]. "
+        "Can be set multiple times."
+    },
     {
         FLB_CONFIG_MAP_STR, "input_field", NULL,
         0, FLB_FALSE, 0,
@@ -623,6 +2258,16 @@ static struct flb_config_map config_map[] = {
         0, FLB_FALSE, 0,
         "Divide input feature values to this value (e.g. divide image pixles by 255)."
     },
+    {
+        FLB_CONFIG_MAP_STR, "input_encoding", "u8",
+        0, FLB_FALSE, 0,
+        "Encoding of the elements of binary inputs (u8 | i8 | u16 | f16 | f32 | i32)"
+    },
+    {
+        FLB_CONFIG_MAP_STR, "input_endianness", "little",
+        0, FLB_FALSE, 0,
+        "Byte order of the multi-byte elements of binary inputs (little | big)"
+    },
     {
         FLB_CONFIG_MAP_INT, "output_size", 0,
         0, FLB_TRUE, offsetof(struct flb_tensorflow, output_size),
@@ -637,6 +2282,148 @@ static struct flb_config_map config_map[] = {
         0, FLB_FALSE, 0,
         "The device to run TensorFlow Lite on (cpu | gpu)"
     },
+    {
+        FLB_CONFIG_MAP_STR, "trace_file", NULL,
+        0, FLB_FALSE, 0,
+        "Record parse, preprocess, invoke and pack spans into this file (Chrome trace event format)"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "trace_flush_ms", "1000",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, trace_flush_ms),
+        "Interval the trace spans are written to trace_file at (milliseconds)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "inference_threads", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, inference_threads),
+        "Number of TensorFlow Lite threads per model (0: TensorFlow Lite default)."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "inference_cpus", NULL,
+        0, FLB_FALSE, 0,
+        "CPUs the TensorFlow Lite worker threads run on, e.g. 2-3,6 (default: any CPU)"
+    },
+    {
+        FLB_CONFIG_MAP_STR, "inference_sched_policy", NULL,
+        0, FLB_FALSE, 0,
+        "Scheduling policy of the TensorFlow Lite worker threads (other | fifo | rr, default: inherited)"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "inference_sched_priority", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, inference_sched_priority),
+        "Scheduling priority of the TensorFlow Lite worker threads (1-99 for fifo and rr)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "tile_frame_width", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, tile_frame_width),
+        "Width of the frames cut into model-sized tiles (pixels, 0: tiling disabled)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "tile_frame_height", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, tile_frame_height),
+        "Height of the frames cut into model-sized tiles (pixels)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "tile_stride", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, tile_stride),
+        "Distance between neighbouring tiles (pixels, 0: tile size, i.e. no overlap)."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "reference_file", NULL,
+        0, FLB_FALSE, 0,
+        "File of float32 reference embeddings. If set, only the ids and scores of the "
+        "closest references are included in the output."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "similarity_metric", "cosine",
+        0, FLB_FALSE, 0,
+        "Similarity between the output embedding and the references (cosine | dot)"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "similarity_top_k", "5",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, similarity_top_k),
+        "The number of closest references included in the output."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "ivf_lists", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, ivf_lists),
+        "Partition the references into this number of IVF lists (0: exhaustive search)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "ivf_probes", "4",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, ivf_probes),
+        "The number of IVF lists closest to the output embedding that are searched."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "gate_model_file", NULL,
+        0, FLB_FALSE, 0,
+        "Address of a cheap TensorFlow Lite model (.tflite) that runs on every record "
+        "and decides if the main model runs."
+    },
+    {
+        FLB_CONFIG_MAP_DOUBLE, "gate_threshold", "0.5",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, gate_threshold),
+        "The main model runs only if a gate model output is above this value."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "gate_output_index", "-1",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, gate_output_index),
+        "Index of the gate model output compared against gate_threshold (-1: any output)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "max_age_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, max_age_ms),
+        "Skip inference for records older than this (milliseconds, 0: disabled)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "latency_budget_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, latency_budget_ms),
+        "Sample records down while they are queued for longer than this budget, "
+        "at the ratio of the invoke latency to the arrival interval "
+        "(milliseconds, 0: disabled)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "max_invoke_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, max_invoke_ms),
+        "Cancel interpreter invokes running longer than this (milliseconds, 0: disabled)."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "output_mode", "record",
+        0, FLB_FALSE, 0,
+        "Emit a result per record, per-class statistics per window of records, results "
+        "only when the top-1 label changes, or a record per batch of results "
+        "(record | window | transition | columnar)"
+    },
+    {
+        FLB_CONFIG_MAP_INT, "window_records", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, window_records),
+        "Window output mode: number of records per window (0: no limit)."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "window_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, window_ms),
+        "Window output mode: duration of a window (milliseconds of record time, 0: no limit)."
+    },
+    {
+        FLB_CONFIG_MAP_DOUBLE, "transition_high", "0.5",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, transition_high),
+        "Transition output mode: score a label has to reach to be taken."
+    },
+    {
+        FLB_CONFIG_MAP_DOUBLE, "transition_low", "0.4",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, transition_low),
+        "Transition output mode: score below which a label is dropped."
+    },
+    {
+        FLB_CONFIG_MAP_INT, "batch_records", "256",
+        0, FLB_TRUE, offsetof(struct flb_tensorflow, batch_records),
+        "Columnar output mode: maximum number of records per output record."
+    },
+    {
+        FLB_CONFIG_MAP_STR, "record_id_field", NULL,
+        0, FLB_FALSE, 0,
+        "Columnar output mode: record field used as the id of the rows "
+        "(default: position of the record in the chunk)."
+    },
     /* EOF */
     {0}
 };
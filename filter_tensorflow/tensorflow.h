@@ -20,17 +20,42 @@
 #ifndef FLB_FILTER_TF_H
 #define FLB_FILTER_TF_H
 
+/* frame rings (i.e. camera instances) a filter instance can map */
+#define FLB_TF_FRAME_RINGS 8
+
+/* per-tag routes (and distinct route models) of a filter instance */
+#define FLB_TF_ROUTES 16
+
+/* element encodings of binary inputs */
+enum input_encoding {
+    INPUT_ENCODING_U8,
+    INPUT_ENCODING_I8,
+    INPUT_ENCODING_U16,
+    INPUT_ENCODING_F16,
+    INPUT_ENCODING_F32,
+    INPUT_ENCODING_I32
+};
+
+/* what is emitted for the inferred records */
+enum output_mode {
+    OUTPUT_MODE_RECORD,      /* a result per record */
+    OUTPUT_MODE_WINDOW,      /* per-class statistics per window of records */
+    OUTPUT_MODE_TRANSITION,  /* a result per change of the top-1 label */
+    OUTPUT_MODE_COLUMNAR     /* a record per batch of results */
+};
+
 struct out_ordering_buffer {
     void *ordered_output;
     int *ordered_output_idx;
 };
 
-struct flb_tensorflow {
+/* a TensorFlow Lite model, its interpreter and IO buffers */
+struct flb_tf_model {
+    flb_sds_t path;
     TfLiteModel* model;
     TfLiteInterpreterOptions* interpreter_options;
     TfLiteInterpreter* interpreter;
     TfLiteDelegate* delegate;
-    flb_sds_t input_field;
     TfLiteType input_tensor_type;
     TfLiteType output_tensor_type;
 
@@ -41,11 +66,149 @@ struct flb_tensorflow {
     int input_byte_size;
     int output_tensor_size;
     int output_byte_size;
+
+    /* batch dimension the input tensor is resized to (tiled inference) */
+    int batch_size;
+
+    /*
+     * admission control state: records routed to different models queue
+     * for different interpreters
+     */
+    double invoke_latency_ewma;
+    double arrival_interval_ewma;
+    struct flb_time last_record_time;
+    int has_last_record_time;
+    uint64_t admission_seq;
+};
+
+/* preprocessing of the input field */
+struct flb_tf_preprocess {
+    float *normalization_value;
+    int input_encoding;
+    int input_big_endian;
+};
+
+/* records with a tag matching the pattern are inferred by their own model */
+struct flb_tf_route {
+    flb_sds_t match;
+    struct flb_tf_model *model;
+    float normalization_value;
+    struct flb_tf_preprocess pre;
+};
+
+/* top-left corner of a tile in the frame */
+struct tile_offset {
+    int x;
+    int y;
+};
+
+struct flb_tensorflow {
+    struct flb_tf_model *model;
+    flb_sds_t input_field;
     int device;
 
-    /* feature scaling/normalization */
+    /*
+     * model cascade: the gate model runs on every record and the main model
+     * only runs when one of the gate outputs exceeds gate_threshold
+     */
+    struct flb_tf_model *gate;
+    double gate_threshold;
+    int gate_output_index;
+
+    /* feature scaling/normalization, and encoding of binary inputs */
     bool include_input_fields;
-    float* normalization_value;
+    struct flb_tf_preprocess pre;
+
+    /*
+     * per-tag routing: records are inferred by the model of the first route
+     * matching their tag, or by model_file otherwise. Models are loaded once
+     * per file, and shared by the routes using them.
+     */
+    struct mk_list *route_list;
+    struct flb_tf_route routes[FLB_TF_ROUTES];
+    int route_count;
+    struct flb_tf_model *models[FLB_TF_ROUTES];
+    int model_count;
+
+    /*
+     * admission control: records older than max_age_ms are not inferred, and
+     * records are sampled down while they are queued for longer than the
+     * latency budget, at the ratio of the invoke latency to the arrival
+     * interval of their model (EWMAs, kept per model)
+     */
+    int max_age_ms;
+    int latency_budget_ms;
+    uint64_t stale_records;
+    uint64_t shed_records;
+    struct cmt_counter *cmt_stale_records;
+    struct cmt_counter *cmt_shed_records;
+
+    /*
+     * TensorFlow Lite worker threads: their number, and the CPUs and
+     * scheduling policy they are started with
+     */
+    int inference_threads;
+    struct thread_placement inference_placement;
+    int inference_sched_priority;
+
+    /* span tracing (parse, preprocess, invoke and pack) into trace_file */
+    struct trace *trace;
+    int trace_flush_ms;
+
+    /* invoke watchdog: running invokes are cancelled after max_invoke_ms */
+    int max_invoke_ms;
+    double invoke_deadline;
+    uint64_t timeout_records;
+    struct cmt_counter *cmt_timeout_records;
+
+    /* shared memory frame rings, mapped the first time a record references them */
+    struct frame_ring frame_rings[FLB_TF_FRAME_RINGS];
+    int frame_ring_count;
+    uint64_t overwritten_records;
+    struct cmt_counter *cmt_overwritten_records;
+
+    /*
+     * tiled inference: frames of tile_frame_width x tile_frame_height pixels
+     * are cut into (overlapping) model-sized tiles, inferred in one batch
+     */
+    int tile_frame_width;
+    int tile_frame_height;
+    int tile_stride;
+    int tile_width;
+    int tile_height;
+    int tile_channels;
+    int tile_count;
+    struct tile_offset *tiles;
+
+    /* top-k search of the output embeddings against reference embeddings */
+    struct flb_tf_similarity *similarity;
+    int similarity_top_k;
+    int ivf_lists;
+    int ivf_probes;
+
+    /*
+     * window and transition modes: per-tag statistics over windows of
+     * records, or results only when the top-1 label changes
+     */
+    int output_mode;
+    int window_records;
+    int window_ms;
+    double transition_high;
+    double transition_low;
+    struct flb_tf_temporal *temporal;
+
+    /*
+     * columnar mode: the outputs of up to batch_records inferred records are
+     * emitted as a single record, with parallel arrays of timestamps and ids
+     * and the outputs as a matrix (one row per record)
+     */
+    int batch_records;
+    flb_sds_t record_id_field;
+    int batch_rows;
+    struct flb_time batch_time;
+    double *batch_timestamps;
+    msgpack_object *batch_ids;
+    char *batch_output;
 
     /* output format */
     int output_size;
@@ -54,7 +217,7 @@ struct flb_tensorflow {
     struct flb_filter_instance *ins;
 };
 
-void max_output_ordering_float(struct flb_tensorflow *ctx)
+void max_output_ordering_float(struct flb_tensorflow *ctx, float *output, int size)
 {
     int f_idx;
     int* ordered_output_idx;
@@ -64,11 +227,12 @@ void max_output_ordering_float(struct flb_tensorflow *ctx)
     ordered_output = (float *) ctx->out_ordering_buffer.ordered_output;
     ordered_output_idx = ctx->out_ordering_buffer.ordered_output_idx;
 
-    ordered_output[0] = ((float*) ctx->output)[0];
+    ordered_output[0] = output[0];
     ordered_output_idx[0] = 0;
 
-    for (int i = 1; i < ctx->output_tensor_size; i++) {
-        float value = ((float*) ctx->output)[i];
+    for (int i = 1; i < size; i++) {
+        float value = output[i];
+        int inserted = 0;
 
         if (f_idx == ctx->output_size - 1 && value <= ordered_output[f_idx]) {
             continue;
@@ -77,7 +241,10 @@ void max_output_ordering_float(struct flb_tensorflow *ctx)
         for (int j = 0; j <= f_idx; j++) {
             if (value > ordered_output[j]) {
                 if (j < ctx->output_size - 1) {
-                    for (int shift_idx = f_idx + 1; shift_idx > j; shift_idx--) {
+                    /* the last value drops out once the buffer is full */
+                    int last = (f_idx < ctx->output_size - 1) ? f_idx + 1 : f_idx;
+
+                    for (int shift_idx = last; shift_idx > j; shift_idx--) {
                         ordered_output[shift_idx] = ordered_output[shift_idx - 1];
                         ordered_output_idx[shift_idx] = ordered_output_idx[shift_idx - 1];
                     }
@@ -88,9 +255,17 @@ void max_output_ordering_float(struct flb_tensorflow *ctx)
                 }
                 ordered_output[j] = value;
                 ordered_output_idx[j] = i;
+                inserted = 1;
                 break;
             }
         }
+
+        /* values lower than all the ordered ones fill the buffer up */
+        if (!inserted && f_idx < ctx->output_size - 1) {
+            f_idx++;
+            ordered_output[f_idx] = value;
+            ordered_output_idx[f_idx] = i;
+        }
     }
 }
 
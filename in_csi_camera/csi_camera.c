@@ -17,31 +17,110 @@
  *  limitations under the License.
  */
 
+/* cpu_set_t, pthread_setaffinity_np (thread_placement.h), pthread_timedjoin_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <fluent-bit/flb_input.h>
 #include <fluent-bit/flb_input_plugin.h>
 #include <fluent-bit/flb_config.h>
 #include <fluent-bit/flb_pack.h>
+#include <fluent-bit/flb_time.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include "csi_camera.h"
 #include "video_capture.h"
+#include "recording.h"
+
+/* seconds to wait on exit for the capture thread, before leaving it behind */
+#define CAPTURE_EXIT_TIMEOUT_S 2
+
+/*
+ * while the instance is paused, the capture thread waits for it to be
+ * resumed, with the capture pipeline released (pause_mode release) or left
+ * open (pause_mode idle). Returns true if the plugin is exiting.
+ */
+static int wait_while_paused(struct flb_csi_camera *ctx)
+{
+    int exiting;
 
+    pthread_mutex_lock(&ctx->pause_lock);
+    if (!ctx->paused || ctx->plugin_exit_called) {
+        exiting = ctx->plugin_exit_called;
+        pthread_mutex_unlock(&ctx->pause_lock);
+        return exiting;
+    }
+    pthread_mutex_unlock(&ctx->pause_lock);
+
+    /* the pipeline is released and reopened without holding the lock */
+    if (ctx->pause_mode == PAUSE_RELEASE && ctx->source != SOURCE_REPLAY) {
+        pause_video_stream(ctx);
+    }
 
-pthread_t camera_capture_thread;
+    pthread_mutex_lock(&ctx->pause_lock);
+    while (ctx->paused && !ctx->plugin_exit_called) {
+        pthread_cond_wait(&ctx->pause_cond, &ctx->pause_lock);
+    }
+    exiting = ctx->plugin_exit_called;
+    pthread_mutex_unlock(&ctx->pause_lock);
+
+    if (exiting) {
+        return exiting;
+    }
+
+    if (ctx->source == SOURCE_REPLAY) {
+        replay_restart(ctx);
+    }
+    else if (resume_video_stream(ctx) != 0) {
+        flb_plg_error(ctx->ins, "could not resume the capture pipeline");
+    }
+
+    return exiting;
+}
 
 /* read camera frames is a separate thread (calls are clocking) */
 void *capture_frame_from_camera(void *in_context)
 {
+    int ret;
+    uint64_t start = 0;
     struct flb_csi_camera *ctx = in_context;
 
     while(true) {
-        if (capture_video_frame(ctx) == 0) {
-            ctx->frame = video_frame_ptr();
-        } /* TODO: error returned */
+        if (wait_while_paused(ctx)) {
+            pthread_exit(NULL);
+        }
+
+        if (ctx->trace) {
+            start = trace_now();
+        }
+
+        /* blocks until the next frame is captured (or replayed) and published */
+        if (ctx->source == SOURCE_REPLAY) {
+            ret = replay_frame(ctx);
+        }
         else {
+            ret = capture_video_frame(ctx);
+        }
+        if (ret == 0) {
+            if (ctx->trace) {
+                trace_span(ctx->trace, "capture", "capture", start,
+                           __atomic_load_n(&ctx->frames_captured, __ATOMIC_RELAXED));
+            }
+
+            /* wake the collector up in the event loop */
+            eventfd_write(ctx->frame_event_fd, 1);
+        }
+        else if (ret == -1) {
+            /* TODO: error returned */
             usleep(ctx->frame_capture_sleep_us);
         }
 
-        if (ctx->plugin_exit_called) {
+        if (__atomic_load_n(&ctx->plugin_exit_called, __ATOMIC_ACQUIRE)) {
             pthread_exit(NULL);
         }
 
@@ -49,95 +128,456 @@ void *capture_frame_from_camera(void *in_context)
    }
 }
 
+/*
+ * Every frame buffer slot is a complete record: the msgpack header below,
+ * built once, followed by the frame the capture thread writes in place.
+ *
+ *  [ fixarray 2 | EventTime | map | seq, width, height, encoding, (motion),
+ *    (frames, shape) | "frame": bin32 ] [ frames ]
+ *
+ * The timestamp, sequence number, motion score, frame count and length are
+ * fixed-width fields, which the collector patches before the record is
+ * copied into the chunk.
+ */
+static int record_header_create(struct flb_csi_camera *ctx, msgpack_sbuffer *mp_sbuf)
+{
+    msgpack_packer mp_pck;
+    char zeros[8] = {0};
+    static const char bin32[5] = {(char) 0xc6, 0, 0, 0, 0};
+    static const char uint64[9] = {(char) 0xcf, 0, 0, 0, 0, 0, 0, 0, 0};
+    static const char uint32[5] = {(char) 0xce, 0, 0, 0, 0};
+
+    msgpack_sbuffer_init(mp_sbuf);
+    msgpack_packer_init(&mp_pck, mp_sbuf, msgpack_sbuffer_write);
+
+    /* packing a messagepack record starts with an array of size 2:
+     *  1 - timestamp (EventTime: seconds and nanoseconds, big endian)
+     *  2 - record data
+     */
+    msgpack_pack_array(&mp_pck, 2);
+    msgpack_pack_ext(&mp_pck, 8, 0);
+    ctx->record_time_offset = mp_sbuf->size;
+    msgpack_pack_ext_body(&mp_pck, zeros, 8);
+
+    msgpack_pack_map(&mp_pck, 5 + (ctx->motion_threshold > 0) + 2 * (ctx->frames_per_record > 1));
+    msgpack_pack_str_with_body(&mp_pck, "seq", 3);
+    msgpack_sbuffer_write(mp_sbuf, uint64, sizeof(uint64));
+    ctx->record_seq_offset = mp_sbuf->size - 8;
+    msgpack_pack_str_with_body(&mp_pck, "width", 5);
+    msgpack_pack_int(&mp_pck, ctx->output_width);
+    msgpack_pack_str_with_body(&mp_pck, "height", 6);
+    msgpack_pack_int(&mp_pck, ctx->output_height);
+    msgpack_pack_str_with_body(&mp_pck, "encoding", 8);
+    if (ctx->encoding == ENCODING_JPEG) {
+        msgpack_pack_str_with_body(&mp_pck, "jpeg", 4);
+    }
+    else {
+        msgpack_pack_str_with_body(&mp_pck, "raw", 3);
+    }
+    if (ctx->motion_threshold > 0) {
+        msgpack_pack_str_with_body(&mp_pck, "motion", 6);
+        /* float32: 0xca + 4 bytes */
+        msgpack_pack_float(&mp_pck, 0);
+        ctx->record_motion_offset = mp_sbuf->size - 4;
+    }
+    if (ctx->frames_per_record > 1) {
+        /* frames: count, shape: [count, rows, columns, channels] */
+        msgpack_pack_str_with_body(&mp_pck, "frames", 6);
+        msgpack_sbuffer_write(mp_sbuf, uint32, sizeof(uint32));
+        ctx->record_frames_offset = mp_sbuf->size - 4;
+
+        msgpack_pack_str_with_body(&mp_pck, "shape", 5);
+        msgpack_pack_array(&mp_pck, 4);
+        msgpack_sbuffer_write(mp_sbuf, uint32, sizeof(uint32));
+        ctx->record_shape_offset = mp_sbuf->size - 4;
+        switch (ctx->pixel_format) {
+        case PIXEL_FORMAT_GRAY:
+            msgpack_pack_int(&mp_pck, ctx->output_height);
+            msgpack_pack_int(&mp_pck, ctx->output_width);
+            msgpack_pack_int(&mp_pck, 1);
+            break;
+        case PIXEL_FORMAT_NV12:
+            /* the chroma plane follows the luma plane as extra rows */
+            msgpack_pack_int(&mp_pck, ctx->output_height * 3 / 2);
+            msgpack_pack_int(&mp_pck, ctx->output_width);
+            msgpack_pack_int(&mp_pck, 1);
+            break;
+        default:
+            msgpack_pack_int(&mp_pck, ctx->output_height);
+            msgpack_pack_int(&mp_pck, ctx->output_width);
+            msgpack_pack_int(&mp_pck, 3);
+        }
+    }
+    msgpack_pack_str_with_body(&mp_pck, "frame", 5);
+
+    /*
+     * shared memory transport: the frame is a reference to its slot in the
+     * frame ring, and the record ends with it
+     */
+    if (ctx->frame_transport == TRANSPORT_SHM) {
+        msgpack_pack_map(&mp_pck, 4);
+        msgpack_pack_str_with_body(&mp_pck, "ring", 4);
+        msgpack_pack_str_with_body(&mp_pck, ctx->ring.path, strlen(ctx->ring.path));
+        msgpack_pack_str_with_body(&mp_pck, "slot", 4);
+        msgpack_sbuffer_write(mp_sbuf, uint32, sizeof(uint32));
+        ctx->record_ring_slot_offset = mp_sbuf->size - 4;
+        msgpack_pack_str_with_body(&mp_pck, "seq", 3);
+        msgpack_sbuffer_write(mp_sbuf, uint64, sizeof(uint64));
+        ctx->record_ring_seq_offset = mp_sbuf->size - 8;
+        msgpack_pack_str_with_body(&mp_pck, "length", 6);
+        msgpack_sbuffer_write(mp_sbuf, uint32, sizeof(uint32));
+        ctx->record_length_offset = mp_sbuf->size - 4;
+
+        ctx->record_header_size = mp_sbuf->size;
+        return 0;
+    }
+
+    /*
+     * it is possible to pack the data into an array (of chars), which is still
+     * space-efficient. However, the char-packing loop is very time consuming
+     * and it doesn't simply copy the memory block, similar to a bin.
+     *
+     * bin32 is always used, so the length field doesn't move with the size
+     * of encoded frames.
+     */
+    msgpack_sbuffer_write(mp_sbuf, bin32, sizeof(bin32));
+    ctx->record_length_offset = mp_sbuf->size - 4;
+
+    ctx->record_header_size = mp_sbuf->size;
+
+    return 0;
+}
+
+/* copy the frame counters into the metrics of the instance */
+static void update_frame_metrics(struct flb_csi_camera *ctx, uint64_t ts)
+{
+    char *name = (char *) flb_input_name(ctx->ins);
+
+    cmt_counter_set(ctx->cmt_frames_captured, ts,
+                    __atomic_load_n(&ctx->frames_captured, __ATOMIC_RELAXED),
+                    1, (char *[]) {name});
+    cmt_counter_set(ctx->cmt_frames_dropped, ts,
+                    __atomic_load_n(&ctx->frames_dropped, __ATOMIC_RELAXED),
+                    1, (char *[]) {name});
+    cmt_counter_set(ctx->cmt_frames_overwritten, ts,
+                    __atomic_load_n(&ctx->frames_overwritten, __ATOMIC_RELAXED),
+                    1, (char *[]) {name});
+    cmt_counter_set(ctx->cmt_frames_emitted, ts, ctx->frames_emitted, 1, (char *[]) {name});
+}
+
+/*
+ * adaptive frame rate: the capture thread only keeps every frame_stride-th
+ * frame. The stride doubles while the chunks of the instance fill more than
+ * half of mem_buf_limit, and halves again once they are below a quarter of it.
+ */
+static void adapt_frame_rate(struct flb_csi_camera *ctx)
+{
+    int stride;
+    double usage;
+
+    usage = (double) ctx->ins->mem_chunks_size / ctx->ins->mem_buf_limit;
+    stride = ctx->frame_stride;
+
+    if (usage > 0.5 && stride < ctx->framerate) {
+        stride = stride * 2 < ctx->framerate ? stride * 2 : ctx->framerate;
+    }
+    else if (usage < 0.25 && stride > 1) {
+        stride /= 2;
+    }
+    else {
+        return;
+    }
+
+    __atomic_store_n(&ctx->frame_stride, stride, __ATOMIC_RELAXED);
+    flb_plg_info(ctx->ins, "chunks at %.0f%% of mem_buf_limit, frame rate set to %.1f fps",
+                 usage * 100, (double) ctx->framerate / stride);
+}
+
 static int cb_csi_camera_collect(struct flb_input_instance *ins,
                                  struct flb_config *config, void *in_context)
 {
+    char *record;
+    size_t length;
+    uint32_t motion;
+    double latency;
+    uint64_t ts;
+    uint64_t collect_start = 0;
+    uint64_t pack_start = 0;
+    struct flb_time tm;
+    const struct frame_info *info;
     struct flb_csi_camera *ctx = in_context;
-    msgpack_packer mp_pck;
-    msgpack_sbuffer mp_sbuf;
+    eventfd_t events;
 
     ctx = (struct flb_csi_camera *) in_context;
 
+    if (ctx->trace) {
+        collect_start = trace_now();
+    }
+
     /*
-     * ctx->frame is null when plugin initializes, and points to the frame when the
-     *   first frame is captured.
-     *
-     * ctx->rw_handle.frame_processed is set when the cur"rent frame is processed by the plugin
+     * reset the frame event counter. Frames published since the last
+     * collection are coalesced, only the newest one is packed.
+     */
+    eventfd_read(ctx->frame_event_fd, &events);
+
+    /* nothing to do if no new frame has been captured since the last collection */
+    if (!frame_buffer_acquire(&ctx->frames)) {
+        return 0;
+    }
+
+    /*
+     * the read slot belongs to the collector until the next acquire, so the
+     * capture thread can't overwrite the record while it is patched and copied.
      */
-    if (!ctx->rw_handle.frame_processed) {
-
-        pthread_mutex_lock(&ctx->rw_handle.f_mutex);
-
-        msgpack_sbuffer_init(&mp_sbuf);
-        msgpack_packer_init(&mp_pck, &mp_sbuf, msgpack_sbuffer_write);
-
-        /*
-         * store the new data into the MessagePack buffer,
-         */
-
-        /* packing a messagepack record starts with an array of size 2:
-         *  1 - timestamp
-         *  2 - record data
-         */
-        msgpack_pack_array(&mp_pck, 2);
-        flb_pack_time_now(&mp_pck);
-        /*
-         * TODO: do we need to
-         *   1. memcpy, or msgpack_pack_bin_body (inside msgpack_pack_bin_with_body) does it automatically?
-         *   2. check if the frame is new, or not updated yet?
-         *    - Mutex is required so the frame gets locked until the data is packed.
-         */
-
-        msgpack_pack_map(&mp_pck, 1);
-        msgpack_pack_str_with_body(&mp_pck, "frame", 5);
-
-        /*
-         * it is possible to pack the data into an array (of chars), which is still
-         * space-efficient. However, the char-packing loop is very time consuming
-         * and it doesn't simply copy the memory block, similar to msgpack_pack_bin_body
-         *
-         * msgpack_pack_array(&mp_pck, ctx->frame_size);
-         * for (int i = 0; i < ctx->frame_size; i++) {
-         *    msgpack_pack_char(&mp_pck, (char) ctx->frame[i]);
-         * }
-         */
-        msgpack_pack_bin(&mp_pck, ctx->frame_size);
-        msgpack_pack_bin_body(&mp_pck, (const void*) ctx->frame, ctx->frame_size);
-
-        /* add msgpack buffer to the input data chunk */
-        flb_input_chunk_append_raw(ins, NULL, 0, mp_sbuf.data, mp_sbuf.size);
-        msgpack_sbuffer_destroy(&mp_sbuf);
-
-        /* frame is processed (used by the video capture script) */
-        ctx->rw_handle.frame_processed = true;
-
-        pthread_mutex_unlock(&ctx->rw_handle.f_mutex);
+    record = frame_buffer_read_slot(&ctx->frames);
+    info = frame_buffer_read_info(&ctx->frames);
+
+    if (ctx->trace) {
+        pack_start = trace_now();
+    }
+
+    /* records carry the capture time, not the time they are collected at */
+    put_be32(record + ctx->record_time_offset, info->time.tv_sec);
+    put_be32(record + ctx->record_time_offset + 4, info->time.tv_nsec);
+
+    if (ctx->source == SOURCE_REPLAY) {
+        /* replayed records are complete */
+        length = info->length;
+        flb_input_chunk_append_raw(ins, NULL, 0, record, length);
+        goto emitted;
+    }
+
+    put_be64(record + ctx->record_seq_offset, info->seq);
+
+    if (ctx->motion_threshold > 0) {
+        memcpy(&motion, &info->motion, sizeof(motion));
+        put_be32(record + ctx->record_motion_offset, motion);
+    }
+
+    if (ctx->frames_per_record > 1) {
+        put_be32(record + ctx->record_frames_offset, info->frames);
+        put_be32(record + ctx->record_shape_offset, info->frames);
+    }
+
+    put_be32(record + ctx->record_length_offset, info->length);
+
+    if (ctx->frame_transport == TRANSPORT_SHM) {
+        put_be32(record + ctx->record_ring_slot_offset, info->ring_slot);
+        put_be64(record + ctx->record_ring_seq_offset, info->seq);
+
+        /* the frame stays in the ring, only the reference goes into the chunk */
+        length = ctx->record_header_size;
+    }
+    else {
+        /* the only copy of the frame: into the input data chunk */
+        length = ctx->record_header_size + info->length;
+    }
+    flb_input_chunk_append_raw(ins, NULL, 0, record, length);
+
+emitted:
+    ctx->frames_emitted += info->frames;
+
+    if (ctx->trace) {
+        trace_span(ctx->trace, "collector", "pack", pack_start, info->seq);
+    }
+
+    if (ctx->recording) {
+        recording_write(ctx, record, length, info);
+    }
+
+    flb_time_get(&tm);
+    latency = (tm.tm.tv_sec - info->time.tv_sec) +
+              (tm.tm.tv_nsec - info->time.tv_nsec) / 1e9;
+    ts = cmt_time_now();
+    cmt_histogram_observe(ctx->cmt_capture_latency, ts, latency,
+                          1, (char *[]) {(char *) flb_input_name(ins)});
+    update_frame_metrics(ctx, ts);
+
+    if (ctx->adaptive_framerate) {
+        adapt_frame_rate(ctx);
+    }
+
+    if (ctx->trace) {
+        trace_span(ctx->trace, "collector", "collect", collect_start, info->seq);
+        trace_flush(ctx->trace, FLB_FALSE);
     }
 
     return 0;
 }
 
-static int cb_csi_camera_init(struct flb_input_instance *in,
-                              struct flb_config *config,
-                              void *data)
+/* crop, scale and pixel format of the emitted frames */
+static int configure_output_frame(struct flb_csi_camera *ctx)
 {
-    int ret;
-    time_t seconds;
-    long nanoseconds;
-    struct flb_csi_camera *ctx;
+    const char *tmp;
 
-    ctx = flb_calloc(1, sizeof(struct flb_csi_camera));
+    tmp = flb_input_get_property("crop", ctx->ins);
+    if (tmp) {
+        if (sscanf(tmp, "%d,%d,%d,%d", &ctx->crop_x, &ctx->crop_y,
+                   &ctx->crop_width, &ctx->crop_height) != 4 ||
+            ctx->crop_x < 0 || ctx->crop_y < 0 ||
+            ctx->crop_width <= 0 || ctx->crop_height <= 0 ||
+            ctx->crop_x + ctx->crop_width > ctx->capture_width ||
+            ctx->crop_y + ctx->crop_height > ctx->capture_height) {
+            flb_plg_error(ctx->ins, "Configuration error: crop has to be x,y,width,height "
+                          "inside the captured frame!");
+            return -1;
+        }
+    }
+    else {
+        ctx->crop_x = 0;
+        ctx->crop_y = 0;
+        ctx->crop_width = ctx->capture_width;
+        ctx->crop_height = ctx->capture_height;
+    }
 
-    if (!ctx) {
-      flb_errno();
-      return -1;
+    /* no scaling by default */
+    if (ctx->output_width <= 0) {
+        ctx->output_width = ctx->crop_width;
+    }
+    if (ctx->output_height <= 0) {
+        ctx->output_height = ctx->crop_height;
     }
 
-    ctx->ins = in;
+    tmp = flb_input_get_property("pixel_format", ctx->ins);
+    if (!tmp || strcasecmp(tmp, "bgr") == 0) {
+        ctx->pixel_format = PIXEL_FORMAT_BGR;
+    }
+    else if (strcasecmp(tmp, "rgb") == 0) {
+        ctx->pixel_format = PIXEL_FORMAT_RGB;
+    }
+    else if (strcasecmp(tmp, "gray") == 0) {
+        ctx->pixel_format = PIXEL_FORMAT_GRAY;
+    }
+    else if (strcasecmp(tmp, "nv12") == 0) {
+        ctx->pixel_format = PIXEL_FORMAT_NV12;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: pixel_format must be bgr, rgb, gray or nv12!");
+        return -1;
+    }
 
-    ret = flb_input_config_map_set(in, (void *) ctx);
-    if (ret == -1) {
-        flb_free(ctx);
+    /* pre-calculate frame size */
+    switch (ctx->pixel_format) {
+    case PIXEL_FORMAT_GRAY:
+        ctx->frame_size = ctx->output_width * ctx->output_height;
+        break;
+    case PIXEL_FORMAT_NV12:
+        /* full resolution luma plane, followed by interleaved half resolution chroma */
+        if (ctx->output_width % 2 || ctx->output_height % 2) {
+            flb_plg_error(ctx->ins, "Configuration error: nv12 frame sizes have to be even!");
+            return -1;
+        }
+        ctx->frame_size = ctx->output_width * ctx->output_height * 3 / 2;
+        break;
+    default:
+        ctx->frame_size = ctx->output_width * ctx->output_height * 3;
+    }
+
+    tmp = flb_input_get_property("encoding", ctx->ins);
+    if (!tmp || strcasecmp(tmp, "raw") == 0) {
+        ctx->encoding = ENCODING_RAW;
+    }
+    else if (strcasecmp(tmp, "jpeg") == 0) {
+        ctx->encoding = ENCODING_JPEG;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: encoding must be raw or jpeg!");
+        return -1;
+    }
+
+    if (ctx->encoding == ENCODING_JPEG) {
+        if (ctx->pixel_format != PIXEL_FORMAT_BGR && ctx->pixel_format != PIXEL_FORMAT_GRAY) {
+            flb_plg_error(ctx->ins, "Configuration error: jpeg encoding requires bgr or gray frames!");
+            return -1;
+        }
+        if (ctx->jpeg_quality < 1 || ctx->jpeg_quality > 100) {
+            flb_plg_error(ctx->ins, "Configuration error: jpeg_quality has to be between 1 and 100!");
+            return -1;
+        }
+    }
+
+    if (ctx->frames_per_record < 1) {
+        flb_plg_error(ctx->ins, "Configuration error: frames_per_record has to be >= 1!");
+        return -1;
+    }
+    if (ctx->frames_per_record > 1 && ctx->encoding != ENCODING_RAW) {
+        flb_plg_error(ctx->ins, "Configuration error: frames_per_record requires raw encoding!");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void warn_capture_placement(struct flb_csi_camera *ctx, const char *threads,
+                                   int err_cpus, int err_sched)
+{
+    if (err_cpus) {
+        flb_plg_warn(ctx->ins, "could not set the CPUs of the %s: %s",
+                     threads, strerror(err_cpus));
+    }
+    if (err_sched) {
+        flb_plg_warn(ctx->ins, "could not set the scheduling policy of the %s: %s%s",
+                     threads, strerror(err_sched), err_sched == EPERM ?
+                     " (real-time policies require CAP_SYS_NICE or RLIMIT_RTPRIO)" : "");
+    }
+}
+
+/*
+ * GStreamer starts the streaming threads of a pipeline from the thread that
+ * opens it, and they inherit the CPUs and scheduling policy of that thread.
+ * The pipeline is first opened by the init thread (it is reopened by the
+ * capture thread afterwards, which is placed already): while it is opened,
+ * the init thread takes the capture placement, and gets its own back
+ * afterwards. Returns true if the placement has been taken.
+ */
+static int enter_capture_placement(struct flb_csi_camera *ctx,
+                                   struct thread_placement *saved)
+{
+    int err_cpus;
+    int err_sched;
+
+    if (!ctx->capture_placement.has_cpus && !ctx->capture_placement.has_sched) {
+        return FLB_FALSE;
+    }
+
+    if (thread_placement_get(pthread_self(), saved) == -1) {
+        flb_plg_warn(ctx->ins, "could not get the placement of the init thread, "
+                     "pipeline threads are not placed");
+        return FLB_FALSE;
+    }
+
+    thread_placement_apply(pthread_self(), &ctx->capture_placement, &err_cpus, &err_sched);
+    warn_capture_placement(ctx, "pipeline threads", err_cpus, err_sched);
+
+    return FLB_TRUE;
+}
+
+static void leave_capture_placement(struct flb_csi_camera *ctx,
+                                    struct thread_placement *saved)
+{
+    int err_cpus;
+    int err_sched;
+
+    thread_placement_apply(pthread_self(), saved, &err_cpus, &err_sched);
+    if (err_cpus || err_sched) {
+        flb_plg_warn(ctx->ins, "could not restore the placement of the init thread");
+    }
+}
+
+/*
+ * open the capture pipeline (and the frame ring), and create the frame buffer
+ * slots: records built around the captured frames
+ */
+static int capture_init(struct flb_csi_camera *ctx)
+{
+    int i;
+    int ret;
+    int placed;
+    msgpack_sbuffer mp_sbuf;
+    struct thread_placement saved;
+
+    if (ctx->source == SOURCE_PIPELINE && !ctx->pipeline) {
+        flb_plg_error(ctx->ins, "Configuration error: pipeline is required by the pipeline source!");
         return -1;
     }
 
@@ -152,8 +592,9 @@ static int cb_csi_camera_init(struct flb_input_instance *in,
         return -1;
     }
 
-    /* pre-calculate frame size */
-    ctx->frame_size = ctx->capture_width * ctx->capture_height * 3;
+    if (configure_output_frame(ctx) == -1) {
+        return -1;
+    }
 
     /*
      * C++ API (video_capture.cpp)
@@ -165,7 +606,13 @@ static int cb_csi_camera_init(struct flb_input_instance *in,
      * 2. Is there any event for recieving a frame that we can add to the event loop?
      *   - No
      */
-    if (create_video_stream(ctx) != 0) {
+    placed = enter_capture_placement(ctx, &saved);
+    ret = create_video_stream(ctx);
+    if (placed) {
+        leave_capture_placement(ctx, &saved);
+    }
+
+    if (ret != 0) {
       flb_errno();
       return -1;
     }
@@ -195,8 +642,217 @@ static int cb_csi_camera_init(struct flb_input_instance *in,
 compilation terminated.
     */
 
-    pthread_mutex_init(&ctx->rw_handle.f_mutex, NULL);
-    ctx->rw_handle.frame_processed = true;
+    /*
+     * frames are written into the ring, and frame buffer slots only hold the
+     * records referencing them
+     */
+    if (ctx->frame_transport == TRANSPORT_SHM) {
+        if (frame_ring_create(&ctx->ring, "flb-csi-camera", ctx->shm_slots,
+                              (size_t) ctx->frames_per_record * ctx->frame_size) == -1) {
+            flb_errno();
+            flb_plg_error(ctx->ins, "could not create the shared memory frame ring");
+            return -1;
+        }
+        ctx->ring_next = 0;
+        flb_plg_info(ctx->ins, "frame ring %s: %d slots", ctx->ring.path, ctx->shm_slots);
+    }
+
+    /* slots are records: the record header, followed by a frame */
+    record_header_create(ctx, &mp_sbuf);
+    for (i = 0; i < FRAME_BUFFER_SLOTS; i++) {
+        ctx->frames.slots[i] = flb_malloc(ctx->record_header_size +
+                                          (ctx->frame_transport == TRANSPORT_SHM ? 0 :
+                                           (size_t) ctx->frames_per_record * ctx->frame_size));
+        if (!ctx->frames.slots[i]) {
+            flb_errno();
+            msgpack_sbuffer_destroy(&mp_sbuf);
+            return -1;
+        }
+        memcpy(ctx->frames.slots[i], mp_sbuf.data, ctx->record_header_size);
+    }
+    msgpack_sbuffer_destroy(&mp_sbuf);
+    frame_buffer_init(&ctx->frames);
+
+    return 0;
+}
+
+/*
+ * place the capture thread on capture_cpus with its scheduling policy. It is
+ * not fatal if it fails (e.g. real-time policies without the permissions):
+ * the thread keeps the placement it inherited, and the one in effect is
+ * logged either way.
+ */
+static void place_capture_thread(struct flb_csi_camera *ctx)
+{
+    int err_cpus;
+    int err_sched;
+    char desc[256];
+
+    thread_placement_apply(ctx->capture_thread, &ctx->capture_placement,
+                           &err_cpus, &err_sched);
+
+    warn_capture_placement(ctx, "capture thread", err_cpus, err_sched);
+
+    thread_placement_describe(ctx->capture_thread, desc, sizeof(desc));
+    flb_plg_info(ctx->ins, "capture thread: %s", desc);
+}
+
+static int cb_csi_camera_init(struct flb_input_instance *in,
+                              struct flb_config *config,
+                              void *data)
+{
+    int ret;
+    const char *tmp;
+    struct flb_csi_camera *ctx;
+
+    ctx = flb_calloc(1, sizeof(struct flb_csi_camera));
+
+    if (!ctx) {
+      flb_errno();
+      return -1;
+    }
+
+    ctx->ins = in;
+
+    ret = flb_input_config_map_set(in, (void *) ctx);
+    if (ret == -1) {
+        flb_free(ctx);
+        return -1;
+    }
+
+    tmp = flb_input_get_property("source", in);
+    if (!tmp || strcasecmp(tmp, "csi") == 0) {
+        ctx->source = SOURCE_CSI;
+    }
+    else if (strcasecmp(tmp, "v4l2") == 0) {
+        ctx->source = SOURCE_V4L2;
+    }
+    else if (strcasecmp(tmp, "file") == 0) {
+        ctx->source = SOURCE_FILE;
+    }
+    else if (strcasecmp(tmp, "testsrc") == 0) {
+        ctx->source = SOURCE_TESTSRC;
+    }
+    else if (strcasecmp(tmp, "pipeline") == 0) {
+        ctx->source = SOURCE_PIPELINE;
+    }
+    else if (strcasecmp(tmp, "replay") == 0) {
+        ctx->source = SOURCE_REPLAY;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: source must be csi, v4l2, file, "
+                      "testsrc, pipeline or replay!");
+        return -1;
+    }
+
+    if ((ctx->source == SOURCE_FILE || ctx->source == SOURCE_REPLAY) && !ctx->location) {
+        flb_plg_error(ctx->ins, "Configuration error: location is required by the file "
+                      "and replay sources!");
+        return -1;
+    }
+
+    tmp = flb_input_get_property("replay_mode", in);
+    if (!tmp || strcasecmp(tmp, "original") == 0) {
+        ctx->replay_mode = REPLAY_ORIGINAL;
+    }
+    else if (strcasecmp(tmp, "fixed") == 0) {
+        ctx->replay_mode = REPLAY_FIXED;
+    }
+    else if (strcasecmp(tmp, "max") == 0) {
+        ctx->replay_mode = REPLAY_MAX;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: replay_mode must be original, fixed or max!");
+        return -1;
+    }
+
+    if (ctx->source == SOURCE_REPLAY && ctx->replay_mode == REPLAY_FIXED && ctx->framerate <= 0) {
+        flb_plg_error(ctx->ins, "Configuration error: replay_mode fixed requires framerate!");
+        return -1;
+    }
+
+    tmp = flb_input_get_property("record_compression", in);
+    if (!tmp || strcasecmp(tmp, "none") == 0) {
+        ctx->record_compression = COMPRESSION_NONE;
+    }
+    else if (strcasecmp(tmp, "gzip") == 0) {
+        ctx->record_compression = COMPRESSION_GZIP;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: record_compression must be none or gzip!");
+        return -1;
+    }
+
+    tmp = flb_input_get_property("frame_transport", in);
+    if (!tmp || strcasecmp(tmp, "inline") == 0) {
+        ctx->frame_transport = TRANSPORT_INLINE;
+    }
+    else if (strcasecmp(tmp, "shm") == 0) {
+        ctx->frame_transport = TRANSPORT_SHM;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: frame_transport must be inline or shm!");
+        return -1;
+    }
+
+    if (ctx->frame_transport == TRANSPORT_SHM && ctx->shm_slots < 2) {
+        flb_plg_error(ctx->ins, "Configuration error: shm_slots has to be >= 2!");
+        return -1;
+    }
+
+    /* recordings hold the frames, and replayed records carry them */
+    if (ctx->frame_transport == TRANSPORT_SHM &&
+        (ctx->record_file || ctx->source == SOURCE_REPLAY)) {
+        flb_plg_error(ctx->ins, "Configuration error: frame_transport shm can't be used "
+                      "with record_file or the replay source!");
+        return -1;
+    }
+
+    tmp = flb_input_get_property("trace_file", in);
+    if (tmp) {
+        ctx->trace = trace_create(tmp, flb_input_name(in), ctx->trace_flush_ms);
+        if (!ctx->trace) {
+            flb_errno();
+            flb_plg_error(ctx->ins, "Configuration error: could not open trace_file %s!", tmp);
+            return -1;
+        }
+    }
+
+    tmp = thread_placement_parse(&ctx->capture_placement,
+                                 flb_input_get_property("capture_cpus", in),
+                                 flb_input_get_property("capture_sched_policy", in),
+                                 ctx->capture_sched_priority);
+    if (tmp) {
+        flb_plg_error(ctx->ins, "Configuration error: capture thread placement: %s!", tmp);
+        return -1;
+    }
+
+    tmp = flb_input_get_property("pause_mode", in);
+    if (!tmp || strcasecmp(tmp, "release") == 0) {
+        ctx->pause_mode = PAUSE_RELEASE;
+    }
+    else if (strcasecmp(tmp, "idle") == 0) {
+        ctx->pause_mode = PAUSE_IDLE;
+    }
+    else {
+        flb_plg_error(ctx->ins, "Configuration error: pause_mode must be release or idle!");
+        return -1;
+    }
+
+    /* the replay source neither captures, nor builds its records */
+    if (ctx->source == SOURCE_REPLAY) {
+        ret = replay_open(ctx);
+    }
+    else {
+        ret = capture_init(ctx);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+
+    if (ctx->record_file && recording_open(ctx) == -1) {
+        return -1;
+    }
 
     /* Set the context
            this is necessary for the plugin to exit properly
@@ -206,29 +862,48 @@ compilation terminated.
 
     ctx->plugin_exit_called = 0;
 
-    seconds = 0;
-    nanoseconds = 1000000000 / ctx->framerate;
-    /* framerate is >= 1 */
-    if (nanoseconds == 1000000000) {
-         nanoseconds = 0;
-         seconds = 1;
+    ctx->paused = FLB_FALSE;
+    pthread_mutex_init(&ctx->pause_lock, NULL);
+    pthread_cond_init(&ctx->pause_cond, NULL);
+
+    ctx->frame_stride = 1;
+    if (ctx->adaptive_framerate && ctx->ins->mem_buf_limit == 0) {
+        flb_plg_warn(ctx->ins, "adaptive_framerate requires mem_buf_limit, disabled");
+        ctx->adaptive_framerate = FLB_FALSE;
+    }
+
+    /* signaled by the capture thread every time a frame is published */
+    ctx->frame_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->frame_event_fd == -1) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not create the frame event descriptor");
+        return -1;
     }
 
-    ctx->frame_capture_sleep_us = 0.4 * (nanoseconds / 1000);
+    /* framerate is >= 1, but for the replay source */
+    if (ctx->framerate > 0) {
+        ctx->frame_capture_sleep_us = 0.4 * (1000000 / ctx->framerate);
+    }
+    else {
+        ctx->frame_capture_sleep_us = 100000;
+    }
     /* frame reading thread */
-    int t = pthread_create(&camera_capture_thread, NULL, capture_frame_from_camera, ctx);
+    int t = pthread_create(&ctx->capture_thread, NULL, capture_frame_from_camera, ctx);
 
     if (t != 0) {
         flb_plg_error(ctx->ins, "Error creating the thread!");
         return -1;
     }
+    place_capture_thread(ctx);
 
-    /* set our collector based on time, CPU usage every 1 second */
-    ret = flb_input_set_collector_time(in,
-                                       cb_csi_camera_collect,
-                                       seconds,
-                                       nanoseconds,
-                                       config);
+    /*
+     * collect the frames as soon as they are captured, instead of polling for
+     * them at the frame rate
+     */
+    ret = flb_input_set_collector_event(in,
+                                        cb_csi_camera_collect,
+                                        ctx->frame_event_fd,
+                                        config);
 
     if (ret == -1) {
         flb_plg_error(ctx->ins, "could not set collector for CIS camera input plugin");
@@ -237,48 +912,126 @@ compilation terminated.
 
     ctx->coll_fd = ret;
 
+    ctx->cmt_frames_captured = cmt_counter_create(in->cmt, "fluentbit", "input",
+                                                  "csi_camera_frames_captured_total",
+                                                  "Frames read from the capture pipeline.",
+                                                  1, (char *[]) {"name"});
+    ctx->cmt_frames_dropped = cmt_counter_create(in->cmt, "fluentbit", "input",
+                                                 "csi_camera_frames_dropped_total",
+                                                 "Frames dropped by the appsink before they were read.",
+                                                 1, (char *[]) {"name"});
+    ctx->cmt_frames_overwritten = cmt_counter_create(in->cmt, "fluentbit", "input",
+                                                     "csi_camera_frames_overwritten_total",
+                                                     "Frames replaced by a newer frame before collection.",
+                                                     1, (char *[]) {"name"});
+    ctx->cmt_frames_emitted = cmt_counter_create(in->cmt, "fluentbit", "input",
+                                                 "csi_camera_frames_emitted_total",
+                                                 "Frames appended to the input chunks.",
+                                                 1, (char *[]) {"name"});
+    ctx->cmt_capture_latency = cmt_histogram_create(in->cmt, "fluentbit", "input",
+                                                    "csi_camera_capture_latency_seconds",
+                                                    "Time from frame capture to emission.",
+                                                    cmt_histogram_buckets_create(10, 0.005, 0.01,
+                                                                                 0.02, 0.033,
+                                                                                 0.05, 0.1, 0.2,
+                                                                                 0.5, 1.0, 2.0),
+                                                    1, (char *[]) {"name"});
+
     return 0;
 }
 
+/*
+ * the engine pauses the instance when it is over its memory limit: the
+ * capture thread stops capturing too, instead of reading frames that would
+ * be dropped anyway
+ */
 static void cb_csi_camera_pause(void *data, struct flb_config *config)
 {
     struct flb_csi_camera *ctx = data;
 
     flb_input_collector_pause(ctx->coll_fd, ctx->ins);
+
+    pthread_mutex_lock(&ctx->pause_lock);
+    ctx->paused = FLB_TRUE;
+    pthread_mutex_unlock(&ctx->pause_lock);
 }
 
 static void cb_csi_camera_resume(void *data, struct flb_config *config)
 {
     struct flb_csi_camera *ctx = data;
+
+    pthread_mutex_lock(&ctx->pause_lock);
+    ctx->paused = FLB_FALSE;
+    pthread_cond_signal(&ctx->pause_cond);
+    pthread_mutex_unlock(&ctx->pause_lock);
+
     flb_input_collector_resume(ctx->coll_fd, ctx->ins);
 }
 
 static int cb_csi_camera_exit(void *data, struct flb_config *config)
 {
+    int i;
     int t;
+    struct timespec deadline;
     struct flb_csi_camera *ctx = data;
 
-    /* informing the frame capture thread to exit using plugin_exit variable */
-    ctx->plugin_exit_called = 1;
-
-    /* frame-capture thread maybe waiting on the mutex */
-    ctx->rw_handle.frame_processed = true;
-
-    /* release capture device */
-    release_video_capture_device();
+    /*
+     * informing the frame capture thread to exit using plugin_exit variable,
+     * and waking it up if it is paused
+     */
+    pthread_mutex_lock(&ctx->pause_lock);
+    __atomic_store_n(&ctx->plugin_exit_called, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&ctx->pause_cond);
+    pthread_mutex_unlock(&ctx->pause_lock);
 
     void* status;
 
-    /* this is to wait for the capture thread to exit, before exiting the plugin */
-    t = pthread_join(camera_capture_thread, &status);
+    /*
+     * this is to wait for the capture thread to exit, before exiting the plugin.
+     * The thread leaves after its current read, and only then the capture
+     * device of this instance is released. The capture device can't be
+     * touched while the thread reads from it: if the read doesn't return
+     * (stalled or unplugged camera), the thread is detached and the instance
+     * is left to it, device and buffers included, rather than freed under it.
+     */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CAPTURE_EXIT_TIMEOUT_S;
+    t = pthread_timedjoin_np(ctx->capture_thread, &status, &deadline);
+    if (t == ETIMEDOUT) {
+        flb_plg_warn(ctx->ins, "capture thread blocked in a read for %d s, leaving it "
+                     "behind without releasing the capture device", CAPTURE_EXIT_TIMEOUT_S);
+        pthread_detach(ctx->capture_thread);
+        return 0;
+    }
     if (t != 0)
     {
         flb_plg_error(ctx->ins, "Error in image capture thread handling!");
     }
 
-    flb_free(ctx);
+    /* release capture device */
+    release_video_capture_device(ctx);
+
+    if (ctx->trace) {
+        flb_plg_info(ctx->ins, "trace written, %lu spans dropped", trace_dropped(ctx->trace));
+        trace_destroy(ctx->trace);
+    }
 
-    flb_plg_info(ctx->ins, "CSI camera plugin exited");
+    close(ctx->frame_event_fd);
+
+    flb_plg_info(ctx->ins, "CSI camera plugin exited: %lu frames captured, %lu dropped, "
+                 "%lu overwritten, %lu emitted",
+                 ctx->frames_captured, ctx->frames_dropped,
+                 ctx->frames_overwritten, ctx->frames_emitted);
+
+    for (i = 0; i < FRAME_BUFFER_SLOTS; i++) {
+        flb_free(ctx->frames.slots[i]);
+    }
+    frame_ring_destroy(&ctx->ring);
+    recording_close(ctx);
+    replay_close(ctx);
+    pthread_mutex_destroy(&ctx->pause_lock);
+    pthread_cond_destroy(&ctx->pause_cond);
+    flb_free(ctx);
 
     return 0;
 }
@@ -324,6 +1077,149 @@ static struct flb_config_map config_map[] = {
         0, FLB_TRUE, offsetof(struct flb_csi_camera, flip_method),
         "Flip method",
     },
+    {
+        FLB_CONFIG_MAP_INT, "output_width", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, output_width),
+        "Width of the emitted frames (pixels, default: no scaling)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "output_height", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, output_height),
+        "Height of the emitted frames (pixels, default: no scaling)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "crop", NULL,
+        0, FLB_FALSE, 0,
+        "Region of the captured frame that is emitted: x,y,width,height (pixels)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "pixel_format", "bgr",
+        0, FLB_FALSE, 0,
+        "Pixel format of the emitted frames (bgr | rgb | gray | nv12)",
+    },
+    {
+        FLB_CONFIG_MAP_DOUBLE, "motion_threshold", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, motion_threshold),
+        "Emit only frames with a motion score (mean luma difference, 0-255) above "
+        "the threshold (0: disabled)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "motion_min_interval_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, motion_min_interval_ms),
+        "Minimum time between frames emitted for motion (milliseconds)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "keyframe_interval", "10",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, keyframe_interval),
+        "Emit a frame every keyframe_interval seconds even without motion (0: disabled)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "frames_per_record", "1",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, frames_per_record),
+        "Number of consecutive frames packed into a record",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "max_batch_latency_ms", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, max_batch_latency_ms),
+        "Emit an incomplete burst once its first frame is this old (milliseconds, 0: disabled)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "frame_transport", "inline",
+        0, FLB_FALSE, 0,
+        "How frames are handed to the filters: in the records, or in a shared memory ring (inline | shm)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "shm_slots", "8",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, shm_slots),
+        "Number of records (slots) in the shared memory frame ring",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "trace_file", NULL,
+        0, FLB_FALSE, 0,
+        "Record capture, collect and pack spans into this file (Chrome trace event format)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "trace_flush_ms", "1000",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, trace_flush_ms),
+        "Interval the trace spans are written to trace_file at (milliseconds)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "capture_cpus", NULL,
+        0, FLB_FALSE, 0,
+        "CPUs the capture thread runs on, e.g. 2-3,6 (default: any CPU)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "capture_sched_policy", NULL,
+        0, FLB_FALSE, 0,
+        "Scheduling policy of the capture thread (other | fifo | rr, default: inherited)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "capture_sched_priority", "0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, capture_sched_priority),
+        "Scheduling priority of the capture thread (1-99 for fifo and rr)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "pause_mode", "release",
+        0, FLB_FALSE, 0,
+        "What happens to the capture pipeline while the instance is paused (release | idle)",
+    },
+    {
+        FLB_CONFIG_MAP_BOOL, "adaptive_framerate", "false",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, adaptive_framerate),
+        "Lower the frame rate while the chunks of the instance back up",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "encoding", "raw",
+        0, FLB_FALSE, 0,
+        "Encoding of the emitted frames (raw | jpeg)",
+    },
+    {
+        FLB_CONFIG_MAP_INT, "jpeg_quality", "85",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, jpeg_quality),
+        "Quality of jpeg encoded frames (1-100)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "record_file", NULL,
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, record_file),
+        "Record the emitted records into this file, for the replay source",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "record_compression", "none",
+        0, FLB_FALSE, 0,
+        "Compression of the recorded records (none | gzip)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "replay_mode", "original",
+        0, FLB_FALSE, 0,
+        "Pacing of the replay source: recorded timing, framerate, or as fast as "
+        "possible (original | fixed | max)",
+    },
+    {
+        /* parsed in cb_csi_camera_init, since it is not stored as a string */
+        FLB_CONFIG_MAP_STR, "source", "csi",
+        0, FLB_FALSE, 0,
+        "Frame source (csi | v4l2 | file | testsrc | pipeline | replay)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "device", "/dev/video0",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, device),
+        "V4L2 device of the v4l2 source",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "location", NULL,
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, location),
+        "Video file, URI or image directory of the file source, or recording of the replay source",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "test_pattern", "smpte",
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, test_pattern),
+        "videotestsrc pattern of the testsrc source (e.g. smpte, ball, snow)",
+    },
+    {
+        FLB_CONFIG_MAP_STR, "pipeline", NULL,
+        0, FLB_TRUE, offsetof(struct flb_csi_camera, pipeline),
+        "GStreamer pipeline of the pipeline source, ending with a BGR appsink",
+    },
     /* EOF
      *  https://github.com/fluent/fluent-bit/blob/v1.9.4/src/flb_config_map.c#L276
      */
@@ -333,7 +1229,7 @@ static struct flb_config_map config_map[] = {
 /* in_ prefix and _plugin are required in naming the struct */
 struct flb_input_plugin in_csi_camera_plugin = {
     .name         = "csi_camera",
-    .description  = "NVIDIA Jetson CSI camera frame reader",
+    .description  = "NVIDIA Jetson CSI camera (and other video sources) frame reader",
     .cb_init      = cb_csi_camera_init,
     .cb_pre_run   = NULL,
     .cb_collect   = cb_csi_camera_collect,
@@ -20,37 +20,223 @@
 #ifndef FLB_INPUT_CSI_H
 #define FLB_INPUT_CSI_H
 
-/* handling frame capture/storage and processing */
-struct rw_handling {
-    pthread_mutex_t f_mutex;
-    /* plugin sets this flag after processing the current thread */
-    int frame_processed;
+#include <stdio.h>
+#include <pthread.h>
+#include <fluent-bit/flb_sds.h>
+#include <cmetrics/cmt_counter.h>
+#include <cmetrics/cmt_histogram.h>
+
+#include "frame_buffer.h"
+#include "frame_ring.h"
+#include "thread_placement.h"
+#include "trace.h"
+
+/* capture device state, owned by the C++ capture code (video_capture.cpp) */
+struct video_capture;
+
+/* where frames are captured from */
+enum capture_source {
+    SOURCE_CSI,       /* Jetson CSI camera (nvarguscamerasrc) */
+    SOURCE_V4L2,      /* V4L2 device, e.g. USB camera */
+    SOURCE_FILE,      /* video file, URI or image directory, looping */
+    SOURCE_TESTSRC,   /* synthetic test pattern */
+    SOURCE_PIPELINE,  /* GStreamer pipeline ending with a BGR appsink */
+    SOURCE_REPLAY     /* records of a recording (record_file) */
+};
+
+/* pixel format of the emitted frames */
+enum pixel_format {
+    PIXEL_FORMAT_BGR,
+    PIXEL_FORMAT_RGB,
+    PIXEL_FORMAT_GRAY,
+    PIXEL_FORMAT_NV12
+};
+
+/* encoding of the emitted frames */
+enum frame_encoding {
+    ENCODING_RAW,
+    ENCODING_JPEG
+};
+
+/* how frames are handed over to the filters */
+enum frame_transport {
+    TRANSPORT_INLINE,  /* in the records */
+    TRANSPORT_SHM      /* in a shared memory ring, referenced by the records */
+};
+
+/* compression of the records in a recording */
+enum recording_compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP
+};
+
+/* pacing of replayed records */
+enum replay_mode {
+    REPLAY_ORIGINAL,  /* at their recorded capture times */
+    REPLAY_FIXED,     /* at framerate */
+    REPLAY_MAX        /* as fast as they are collected */
+};
+
+/* capture pipeline while the instance is paused */
+enum pause_mode {
+    PAUSE_RELEASE,    /* released, and reopened on resume */
+    PAUSE_IDLE        /* left open, frames are not read */
 };
 
 struct flb_csi_camera {
+    int source;
+    flb_sds_t device;
+    flb_sds_t location;
+    flb_sds_t test_pattern;
+    flb_sds_t pipeline;
+
     int sensor_id;
     int capture_width;
     int capture_height;
     int framerate;
     int flip_method;
 
+    /*
+     * emitted frames: the crop rectangle (in capture coordinates) is scaled
+     * to output_width x output_height pixels of the given pixel format
+     */
+    int output_width;
+    int output_height;
+    int crop_x;
+    int crop_y;
+    int crop_width;
+    int crop_height;
+    int pixel_format;
+
+    /*
+     * motion gate (enabled if motion_threshold > 0): only frames with a motion
+     * score above the threshold are emitted, plus a keyframe every
+     * keyframe_interval seconds
+     */
+    double motion_threshold;
+    int motion_min_interval_ms;
+    int keyframe_interval;
+
+    /*
+     * bursts: frames_per_record consecutive frames are packed into one record,
+     * unless the first one is max_batch_latency_ms old
+     */
+    int frames_per_record;
+    int max_batch_latency_ms;
+
+    /* shared memory transport: frames are written into the slots of the ring */
+    int frame_transport;
+    int shm_slots;
+    struct frame_ring ring;
+    int ring_next;            /* owned by the capture thread */
+
+    /* raw frames, or compressed on the capture thread */
+    int encoding;
+    int jpeg_quality;
+
+    /* size of a raw frame */
     int frame_size;
 
-    const char *frame; /* C++ object */
+    /* recording of the emitted records, written by the collector */
+    flb_sds_t record_file;
+    int record_compression;
+    FILE *recording;
+
+    /*
+     * replay source: the records of the recording at location, read by the
+     * capture thread
+     */
+    int replay_mode;
+    int replay_compression;
+    FILE *replay;
+    char *replay_buf;            /* compressed record */
+    size_t replay_buf_size;
+    size_t replay_slot_size;     /* largest record of the recording */
+    int replay_anchored;         /* pacing: replay_first_ns is replayed at replay_start */
+    struct timespec replay_start;
+    uint64_t replay_first_ns;
+    uint64_t replay_count;
+
+    /*
+     * frame buffer slots hold complete records: a header of fixed size, with
+     * the offsets of the fields patched for each frame, followed by the frame
+     */
+    int record_header_size;
+    int record_time_offset;
+    int record_motion_offset;
+    int record_length_offset;
+    int record_seq_offset;
+    int record_frames_offset;
+    int record_shape_offset;
+    int record_ring_slot_offset;
+    int record_ring_seq_offset;
+
+    /*
+     * frame accounting. The capture thread updates its counters atomically,
+     * they are copied into the metrics by the collector.
+     */
+    uint64_t frames_captured;     /* also the sequence number of the last frame */
+    uint64_t frames_dropped;      /* dropped by the appsink (gaps in buffer timestamps) */
+    uint64_t frames_overwritten;  /* replaced by a newer frame before collection */
+    uint64_t frames_emitted;
+    struct cmt_counter *cmt_frames_captured;
+    struct cmt_counter *cmt_frames_dropped;
+    struct cmt_counter *cmt_frames_overwritten;
+    struct cmt_counter *cmt_frames_emitted;
+    struct cmt_histogram *cmt_capture_latency;
+
+    /* capture device and the thread reading frames from it */
+    struct video_capture *capture;
+    pthread_t capture_thread;
+
+    /* span tracing (capture, collect and pack) into trace_file */
+    struct trace *trace;
+    int trace_flush_ms;
+
+    /* CPUs and scheduling policy of the capture thread */
+    struct thread_placement capture_placement;
+    int capture_sched_priority;
+
+    /* frames handed over from the capture thread to the collector */
+    struct frame_buffer frames;
+    /* eventfd the capture thread signals when a new frame is published */
+    int frame_event_fd;
 
     /*
-     * if previous frame is not processed or a new frame couldn't captured,
-     *  sleep the thread for this time (0.4 of the plugin collection time)
+     * if a new frame couldn't captured, sleep the thread for this time
+     *  (0.4 of the frame period) before trying again
      */
     int frame_capture_sleep_us;
     /* tells frame capture thread to exit (set when plugin is exiting) */
     int plugin_exit_called;
 
-    int coll_fd;
+    /* the capture thread waits on pause_cond while the instance is paused */
+    int pause_mode;
+    int paused;
+    pthread_mutex_t pause_lock;
+    pthread_cond_t pause_cond;
+
+    /* adaptive frame rate: only every frame_stride-th frame is captured */
+    int adaptive_framerate;
+    int frame_stride;
 
-    struct rw_handling rw_handle;
+    int coll_fd;
 
     struct flb_input_instance *ins;
 };
 
+static inline void put_be32(char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void put_be64(char *p, uint64_t v)
+{
+    put_be32(p, v >> 32);
+    put_be32(p + 4, v);
+}
+
 #endif
@@ -0,0 +1,131 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_INPUT_CSI_FRAME_BUFFER_H
+#define FLB_INPUT_CSI_FRAME_BUFFER_H
+
+/*
+ * Lock-free triple buffer between the frame capture thread (writer) and the
+ * plugin collector (reader). The writer always owns a free slot to capture
+ * into, the reader owns the slot it is packing, and the third slot holds the
+ * newest complete frame. Handing a slot over is a single atomic exchange of
+ * the shared index, so none of the threads ever waits for the other one.
+ *
+ * The __atomic builtins are used (instead of C11 atomics) since this header
+ * is shared with the C++ capture code.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#define FRAME_BUFFER_SLOTS 3
+
+/* set on the shared index when it holds a frame the reader hasn't seen */
+#define FRAME_BUFFER_FRESH 0x4
+#define FRAME_BUFFER_INDEX 0x3
+
+/* per-frame metadata, handed over along with the slot */
+struct frame_info {
+    int length;            /* bytes used in the slot (encoded frames vary in size) */
+    int frames;            /* number of frames in the slot */
+    int ring_slot;         /* slot of the frame ring holding the frames (shm transport) */
+    float motion;          /* motion score, if the motion gate is enabled */
+    uint64_t seq;          /* sequence number of the (first) captured frame */
+    struct timespec time;  /* capture time (CLOCK_REALTIME) of the first frame */
+};
+
+struct frame_buffer {
+    char *slots[FRAME_BUFFER_SLOTS];
+    struct frame_info info[FRAME_BUFFER_SLOTS];
+
+    int write_idx;   /* owned by the capture thread */
+    int read_idx;    /* owned by the collector */
+    int shared_idx;  /* exchanged between both */
+};
+
+static inline void frame_buffer_init(struct frame_buffer *fb)
+{
+    fb->write_idx = 0;
+    fb->shared_idx = 1;
+    fb->read_idx = 2;
+}
+
+/* slot the capture thread writes the next frame into */
+static inline char *frame_buffer_write_slot(struct frame_buffer *fb)
+{
+    return fb->slots[fb->write_idx];
+}
+
+/* metadata of the frame in the write slot, filled in before it is published */
+static inline struct frame_info *frame_buffer_write_info(struct frame_buffer *fb)
+{
+    return &fb->info[fb->write_idx];
+}
+
+/*
+ * publish the frame in the write slot as the newest one. Returns true if
+ * the previous frame was overwritten before the reader picked it up.
+ */
+static inline int frame_buffer_publish(struct frame_buffer *fb)
+{
+    int prev;
+
+    prev = __atomic_exchange_n(&fb->shared_idx, fb->write_idx | FRAME_BUFFER_FRESH,
+                               __ATOMIC_ACQ_REL);
+    fb->write_idx = prev & FRAME_BUFFER_INDEX;
+
+    return (prev & FRAME_BUFFER_FRESH) != 0;
+}
+
+/* true while the newest frame hasn't been picked up by the reader */
+static inline int frame_buffer_pending(struct frame_buffer *fb)
+{
+    return (__atomic_load_n(&fb->shared_idx, __ATOMIC_ACQUIRE) & FRAME_BUFFER_FRESH) != 0;
+}
+
+/*
+ * take the newest frame (if there is one the reader hasn't seen) into the
+ * read slot. Returns true if a new frame is available.
+ */
+static inline int frame_buffer_acquire(struct frame_buffer *fb)
+{
+    int prev;
+
+    if (!(__atomic_load_n(&fb->shared_idx, __ATOMIC_ACQUIRE) & FRAME_BUFFER_FRESH)) {
+        return 0;
+    }
+
+    prev = __atomic_exchange_n(&fb->shared_idx, fb->read_idx, __ATOMIC_ACQ_REL);
+    fb->read_idx = prev & FRAME_BUFFER_INDEX;
+
+    return 1;
+}
+
+/* slot holding the frame acquired by the reader */
+static inline char *frame_buffer_read_slot(struct frame_buffer *fb)
+{
+    return fb->slots[fb->read_idx];
+}
+
+static inline const struct frame_info *frame_buffer_read_info(struct frame_buffer *fb)
+{
+    return &fb->info[fb->read_idx];
+}
+
+#endif
@@ -0,0 +1,386 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* cpu_set_t and pthread_setaffinity_np (thread_placement.h) */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fluent-bit/flb_input_plugin.h>
+#include <fluent-bit/flb_gzip.h>
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "recording.h"
+
+static inline uint32_t get_be32(const char *p)
+{
+    return (uint32_t) (uint8_t) p[0] << 24 | (uint32_t) (uint8_t) p[1] << 16 |
+           (uint32_t) (uint8_t) p[2] << 8 | (uint8_t) p[3];
+}
+
+static inline uint64_t get_be64(const char *p)
+{
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+int recording_open(struct flb_csi_camera *ctx)
+{
+    char header[RECORDING_HEADER_SIZE] = {0};
+
+    ctx->recording = fopen(ctx->record_file, "wb");
+    if (!ctx->recording) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not create recording %s", ctx->record_file);
+        return -1;
+    }
+
+    memcpy(header, RECORDING_MAGIC, strlen(RECORDING_MAGIC));
+    header[8] = ctx->record_compression;
+
+    if (fwrite(header, 1, sizeof(header), ctx->recording) != sizeof(header)) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not write recording %s", ctx->record_file);
+        recording_close(ctx);
+        return -1;
+    }
+
+    flb_plg_info(ctx->ins, "recording emitted records to %s", ctx->record_file);
+
+    return 0;
+}
+
+/*
+ * called by the collector. Records are compressed on the event loop, which
+ * costs far more than the record copy: gzip is meant for long recordings.
+ */
+int recording_write(struct flb_csi_camera *ctx, const char *record, size_t length,
+                    const struct frame_info *info)
+{
+    int ret = 0;
+    void *out = NULL;
+    size_t out_size;
+    const char *data = record;
+    size_t size = length;
+    char entry[RECORDING_ENTRY_SIZE];
+
+    if (!ctx->recording) {
+        return 0;
+    }
+
+    if (ctx->record_compression == COMPRESSION_GZIP) {
+        if (flb_gzip_compress((void *) record, length, &out, &out_size) != 0) {
+            flb_plg_error(ctx->ins, "could not compress the record, not recorded");
+            return -1;
+        }
+        data = out;
+        size = out_size;
+    }
+
+    put_be32(entry, size);
+    put_be32(entry + 4, length);
+    put_be32(entry + 8, info->frames);
+    put_be64(entry + 12, (uint64_t) info->time.tv_sec * 1000000000ULL + info->time.tv_nsec);
+
+    if (fwrite(entry, 1, sizeof(entry), ctx->recording) != sizeof(entry) ||
+        fwrite(data, 1, size, ctx->recording) != size) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not write recording %s, recording stopped",
+                      ctx->record_file);
+        recording_close(ctx);
+        ret = -1;
+    }
+
+    flb_free(out);
+
+    return ret;
+}
+
+void recording_close(struct flb_csi_camera *ctx)
+{
+    if (ctx->recording) {
+        fclose(ctx->recording);
+        ctx->recording = NULL;
+    }
+}
+
+/*
+ * the frame buffer slots have to hold the largest record of the recording.
+ * A truncated last entry (the recording process was killed) ends the
+ * recording.
+ */
+int replay_open(struct flb_csi_camera *ctx)
+{
+    int i;
+    off_t offset;
+    uint32_t stored;
+    uint32_t length;
+    uint64_t count = 0;
+    struct stat st;
+    char header[RECORDING_HEADER_SIZE];
+    char entry[RECORDING_ENTRY_SIZE];
+
+    ctx->replay = fopen(ctx->location, "rb");
+    if (!ctx->replay) {
+        flb_errno();
+        flb_plg_error(ctx->ins, "could not open recording %s", ctx->location);
+        return -1;
+    }
+
+    if (fread(header, 1, sizeof(header), ctx->replay) != sizeof(header) ||
+        memcmp(header, RECORDING_MAGIC, strlen(RECORDING_MAGIC)) != 0 ||
+        (header[8] != COMPRESSION_NONE && header[8] != COMPRESSION_GZIP)) {
+        flb_plg_error(ctx->ins, "%s is not a camera recording", ctx->location);
+        return -1;
+    }
+    ctx->replay_compression = header[8];
+
+    if (fstat(fileno(ctx->replay), &st) == -1) {
+        flb_errno();
+        return -1;
+    }
+
+    offset = RECORDING_HEADER_SIZE;
+    while (fread(entry, 1, sizeof(entry), ctx->replay) == sizeof(entry)) {
+        stored = get_be32(entry);
+        length = get_be32(entry + 4);
+
+        offset += RECORDING_ENTRY_SIZE + stored;
+        if (offset > st.st_size || fseeko(ctx->replay, offset, SEEK_SET) != 0) {
+            break;
+        }
+
+        if (stored > ctx->replay_buf_size) {
+            ctx->replay_buf_size = stored;
+        }
+        if (length > ctx->replay_slot_size) {
+            ctx->replay_slot_size = length;
+        }
+        count++;
+    }
+
+    if (count == 0) {
+        flb_plg_error(ctx->ins, "recording %s holds no records", ctx->location);
+        return -1;
+    }
+
+    fseeko(ctx->replay, RECORDING_HEADER_SIZE, SEEK_SET);
+
+    if (ctx->replay_compression == COMPRESSION_GZIP) {
+        ctx->replay_buf = flb_malloc(ctx->replay_buf_size);
+        if (!ctx->replay_buf) {
+            flb_errno();
+            return -1;
+        }
+    }
+
+    /* replayed records are complete, they are not patched but for their timestamp */
+    for (i = 0; i < FRAME_BUFFER_SLOTS; i++) {
+        ctx->frames.slots[i] = flb_malloc(ctx->replay_slot_size);
+        if (!ctx->frames.slots[i]) {
+            flb_errno();
+            return -1;
+        }
+    }
+    frame_buffer_init(&ctx->frames);
+
+    /* records start with fixarray 2 and a fixext8 EventTime, whose body is the timestamp */
+    ctx->record_time_offset = 3;
+    ctx->replay_anchored = FLB_FALSE;
+
+    flb_plg_info(ctx->ins, "replaying %lu records of %s", count, ctx->location);
+
+    return 0;
+}
+
+/*
+ * wait until the record captured at time_ns is due. Long waits (gaps in the
+ * recording) are cut into short sleeps, so that the plugin can exit. Returns
+ * true if the plugin is exiting.
+ */
+static int replay_wait(struct flb_csi_camera *ctx, uint64_t time_ns)
+{
+    uint64_t offset;
+    struct timespec now;
+    struct timespec next;
+    struct timespec step;
+
+    if (!ctx->replay_anchored ||
+        (ctx->replay_mode == REPLAY_ORIGINAL && time_ns < ctx->replay_first_ns)) {
+        clock_gettime(CLOCK_MONOTONIC, &ctx->replay_start);
+        ctx->replay_first_ns = time_ns;
+        ctx->replay_count = 0;
+        ctx->replay_anchored = FLB_TRUE;
+    }
+
+    if (ctx->replay_mode == REPLAY_ORIGINAL) {
+        offset = time_ns - ctx->replay_first_ns;
+    }
+    else {
+        offset = ctx->replay_count * 1000000000ULL / ctx->framerate;
+    }
+    ctx->replay_count++;
+
+    next.tv_sec = ctx->replay_start.tv_sec + offset / 1000000000ULL;
+    next.tv_nsec = ctx->replay_start.tv_nsec + offset % 1000000000ULL;
+    if (next.tv_nsec >= 1000000000L) {
+        next.tv_sec++;
+        next.tv_nsec -= 1000000000L;
+    }
+
+    while (!__atomic_load_n(&ctx->plugin_exit_called, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec ||
+            (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+            return FLB_FALSE;
+        }
+
+        step = now;
+        step.tv_sec++;
+        if (step.tv_sec > next.tv_sec ||
+            (step.tv_sec == next.tv_sec && step.tv_nsec > next.tv_nsec)) {
+            step = next;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &step, NULL);
+    }
+
+    return FLB_TRUE;
+}
+
+/* read the record of the next entry into slot, starting over at the end */
+static int replay_read(struct flb_csi_camera *ctx, char *slot,
+                       uint32_t *length, uint32_t *frames, uint64_t *time_ns)
+{
+    int ret;
+    uint32_t stored;
+    void *out;
+    size_t out_size;
+    char entry[RECORDING_ENTRY_SIZE];
+
+    if (fread(entry, 1, sizeof(entry), ctx->replay) != sizeof(entry)) {
+        flb_plg_debug(ctx->ins, "end of recording %s, starting over", ctx->location);
+        fseeko(ctx->replay, RECORDING_HEADER_SIZE, SEEK_SET);
+        ctx->replay_anchored = FLB_FALSE;
+
+        if (fread(entry, 1, sizeof(entry), ctx->replay) != sizeof(entry)) {
+            return -1;
+        }
+    }
+
+    stored = get_be32(entry);
+    *length = get_be32(entry + 4);
+    *frames = get_be32(entry + 8);
+    *time_ns = get_be64(entry + 12);
+
+    if (ctx->replay_compression == COMPRESSION_NONE) {
+        if (stored != *length || *length > ctx->replay_slot_size ||
+            fread(slot, 1, *length, ctx->replay) != *length) {
+            goto truncated;
+        }
+        return 0;
+    }
+
+    if (stored > ctx->replay_buf_size ||
+        fread(ctx->replay_buf, 1, stored, ctx->replay) != stored) {
+        goto truncated;
+    }
+
+    ret = flb_gzip_uncompress(ctx->replay_buf, stored, &out, &out_size);
+    if (ret != 0 || out_size != *length || out_size > ctx->replay_slot_size) {
+        if (ret == 0) {
+            flb_free(out);
+        }
+        flb_plg_error(ctx->ins, "corrupted record in recording %s", ctx->location);
+        return -1;
+    }
+    memcpy(slot, out, out_size);
+    flb_free(out);
+
+    return 0;
+
+truncated:
+    /* the record is picked up from the start of the recording next time */
+    fseeko(ctx->replay, 0, SEEK_END);
+    return 1;
+}
+
+int replay_frame(struct flb_csi_camera *ctx)
+{
+    int ret;
+    char *slot;
+    uint32_t length;
+    uint32_t frames;
+    uint64_t time_ns;
+    struct frame_info *info;
+
+    /* as fast as possible, but without overwriting records that haven't been collected */
+    if (ctx->replay_mode == REPLAY_MAX && frame_buffer_pending(&ctx->frames)) {
+        usleep(100);
+        return 1;
+    }
+
+    slot = frame_buffer_write_slot(&ctx->frames);
+    ret = replay_read(ctx, slot, &length, &frames, &time_ns);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (length < ctx->record_time_offset + 8 || slot[0] != (char) 0x92 ||
+        slot[1] != (char) 0xd7 || slot[2] != 0) {
+        flb_plg_error(ctx->ins, "unexpected record in recording %s", ctx->location);
+        return -1;
+    }
+
+    if (ctx->replay_mode != REPLAY_MAX && replay_wait(ctx, time_ns)) {
+        return 1;
+    }
+
+    /*
+     * replayed records are stamped with the replay time, so that the latency
+     * measured downstream is the one of the pipeline
+     */
+    info = frame_buffer_write_info(&ctx->frames);
+    clock_gettime(CLOCK_REALTIME, &info->time);
+    info->length = length;
+    info->frames = frames;
+    info->seq = __atomic_add_fetch(&ctx->frames_captured, frames, __ATOMIC_RELAXED);
+
+    if (frame_buffer_publish(&ctx->frames)) {
+        info = frame_buffer_write_info(&ctx->frames);
+        __atomic_add_fetch(&ctx->frames_overwritten, info->frames, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+void replay_restart(struct flb_csi_camera *ctx)
+{
+    ctx->replay_anchored = FLB_FALSE;
+}
+
+void replay_close(struct flb_csi_camera *ctx)
+{
+    if (ctx->replay) {
+        fclose(ctx->replay);
+        ctx->replay = NULL;
+    }
+    flb_free(ctx->replay_buf);
+    ctx->replay_buf = NULL;
+}
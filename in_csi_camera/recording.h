@@ -0,0 +1,64 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Fluent Bit
+ *  ==========
+ *  Copyright (C) 2022 Masoud Koleini
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef FLB_INPUT_CSI_RECORDING_H
+#define FLB_INPUT_CSI_RECORDING_H
+
+#include "csi_camera.h"
+
+/*
+ * Recordings of emitted records, replayed by the replay source.
+ *
+ * A recording starts with a header of RECORDING_HEADER_SIZE bytes: the magic
+ * followed by the compression of the records. Each record follows as an
+ * entry header (big endian):
+ *
+ *  [ stored length: 4 | record length: 4 | frames: 4 | capture time (ns): 8 ]
+ *
+ * and the record as it was appended to the chunk, compressed or not.
+ */
+#define RECORDING_MAGIC       "FLBCAMR1"
+#define RECORDING_HEADER_SIZE 16
+#define RECORDING_ENTRY_SIZE  20
+
+/* open record_file and write the recording header */
+int recording_open(struct flb_csi_camera *ctx);
+
+/* append an emitted record to the recording */
+int recording_write(struct flb_csi_camera *ctx, const char *record, size_t length,
+                    const struct frame_info *info);
+
+void recording_close(struct flb_csi_camera *ctx);
+
+/* open the recording of the replay source, and allocate the frame buffer slots */
+int replay_open(struct flb_csi_camera *ctx);
+
+/*
+ * read the next record of the recording into the write slot and publish it,
+ * paced by replay_mode. Returns 0 if a record has been published, 1 if not
+ * and -1 on errors.
+ */
+int replay_frame(struct flb_csi_camera *ctx);
+
+/* the pacing starts over, e.g. after the instance has been paused */
+void replay_restart(struct flb_csi_camera *ctx);
+
+void replay_close(struct flb_csi_camera *ctx);
+
+#endif
@@ -23,46 +23,188 @@
 #define EXTERNC
 #endif
 
+#include <cmath>
 #include <iostream>
+#include <time.h>
+#include <sys/stat.h>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/videoio.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/core/types.hpp>
 
 #include "csi_camera.h"
+#include "motion.h"
 
 EXTERNC int create_video_stream(struct flb_csi_camera *);
 
 EXTERNC int capture_video_frame(struct flb_csi_camera *);
-EXTERNC const char *video_frame_ptr();
 
-EXTERNC void release_video_capture_device();
+EXTERNC void pause_video_stream(struct flb_csi_camera *);
+
+EXTERNC int resume_video_stream(struct flb_csi_camera *);
+
+EXTERNC void release_video_capture_device(struct flb_csi_camera *);
 
 #undef EXTERNC
 
-cv::VideoCapture capture;
-cv::Mat img;
+/* capture state of a plugin instance (one per camera) */
+struct video_capture {
+    cv::VideoCapture capture;
+    std::string pipeline;
+
+    /* image directory source: images are decoded in turn, at the frame rate */
+    std::vector<std::string> images;
+    size_t next_image;
+    struct timespec next_frame_time;
+
+    /*
+     * crop, scale and pixel format conversions that couldn't be pushed into
+     * the GStreamer pipeline are done on the captured BGR frame, using
+     * buffers that are kept across frames
+     */
+    bool cpu_crop_scale;
+    bool cpu_convert;
+    cv::Mat frame;
+    cv::Mat scaled;
+    cv::Mat i420;
+
+    /* jpeg encoding: frames are captured into raw, and encoded into encoded */
+    cv::Mat raw;
+    std::vector<uchar> encoded;
+    std::vector<int> encode_params;
+
+    /* motion gate: downsampled luma of the current and the previous frame */
+    cv::Mat motion_small;
+    cv::Mat luma;
+    cv::Mat prev_luma;
+    bool has_prev_luma;
+    int64_t last_emit_ms;
 
-std::string gstreamer_pipeline (int sensor_id, int capture_width, int capture_height, int display_width, int display_height, int framerate, int flip_method) {
-    return "nvarguscamerasrc sensor_id=" + std::to_string(sensor_id) + " ! video/x-raw(memory:NVMM), width=(int)" + std::to_string(capture_width) + ", height=(int)" +
-           std::to_string(capture_height) + ", format=(string)NV12, framerate=(fraction)" + std::to_string(framerate) +
-           "/1 ! nvvidconv flip-method=" + std::to_string(flip_method) + " ! video/x-raw, width=(int)" + std::to_string(display_width) + ", height=(int)" +
-           std::to_string(display_height) + ", format=(string)BGRx ! videoconvert ! video/x-raw, format=(string)BGR ! appsink drop=true";
+    /*
+     * buffer timestamps of live sources: the pipeline running time, mapped
+     * to the wall clock by the smallest offset seen so far
+     */
+    bool live;
+    bool has_time_offset;
+    double time_offset_ms;
+    double last_pos_ms;
+
+    /* adaptive frame rate: frames read since the stream was opened */
+    uint64_t frame_count;
+};
+
+static int64_t monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int create_video_stream(struct flb_csi_camera *ctx)
+/*
+ * OpenCV's appsink only hands out BGR and GRAY8 frames, the other pixel
+ * formats are converted from BGR in capture_video_frame
+ */
+std::string appsink_format (int pixel_format) {
+    std::string format = pixel_format == PIXEL_FORMAT_GRAY ? "GRAY8" : "BGR";
+
+    return "videoconvert ! video/x-raw, format=(string)" + format + " ! appsink drop=true";
+}
+
+/* nvvidconv crops and scales in hardware, before the frame is copied out of NVMM memory */
+std::string gstreamer_pipeline (struct flb_csi_camera *ctx) {
+    return "nvarguscamerasrc sensor_id=" + std::to_string(ctx->sensor_id) + " ! video/x-raw(memory:NVMM), width=(int)" + std::to_string(ctx->capture_width) + ", height=(int)" +
+           std::to_string(ctx->capture_height) + ", format=(string)NV12, framerate=(fraction)" + std::to_string(ctx->framerate) +
+           "/1 ! nvvidconv flip-method=" + std::to_string(ctx->flip_method) +
+           " left=" + std::to_string(ctx->crop_x) + " right=" + std::to_string(ctx->crop_x + ctx->crop_width) +
+           " top=" + std::to_string(ctx->crop_y) + " bottom=" + std::to_string(ctx->crop_y + ctx->crop_height) +
+           " ! video/x-raw, width=(int)" + std::to_string(ctx->output_width) + ", height=(int)" +
+           std::to_string(ctx->output_height) + ", format=(string)BGRx ! " + appsink_format(ctx->pixel_format);
+}
+
+/* crop and scale the frames of the capture size to the output size */
+std::string output_pipeline (struct flb_csi_camera *ctx) {
+    std::string out;
+
+    if (ctx->crop_width != ctx->capture_width || ctx->crop_height != ctx->capture_height) {
+        out += "videocrop left=" + std::to_string(ctx->crop_x) +
+               " top=" + std::to_string(ctx->crop_y) +
+               " right=" + std::to_string(ctx->capture_width - ctx->crop_x - ctx->crop_width) +
+               " bottom=" + std::to_string(ctx->capture_height - ctx->crop_y - ctx->crop_height) + " ! ";
+    }
+    if (ctx->output_width != ctx->crop_width || ctx->output_height != ctx->crop_height) {
+        out += "videoscale ! video/x-raw, width=(int)" + std::to_string(ctx->output_width) +
+               ", height=(int)" + std::to_string(ctx->output_height) + " ! ";
+    }
+
+    return out + appsink_format(ctx->pixel_format);
+}
+
+/* decoded frames of other sources are converted to the capture size and rate */
+std::string appsink_pipeline (struct flb_csi_camera *ctx) {
+    return "videorate ! videoscale ! videoconvert ! video/x-raw, width=(int)" + std::to_string(ctx->capture_width) + ", height=(int)" +
+           std::to_string(ctx->capture_height) + ", framerate=(fraction)" + std::to_string(ctx->framerate) +
+           "/1 ! " + output_pipeline(ctx);
+}
+
+std::string v4l2_pipeline (struct flb_csi_camera *ctx) {
+    return "v4l2src device=" + std::string(ctx->device) + " ! decodebin ! " +
+           appsink_pipeline(ctx);
+}
+
+/* location is either a video file, or a URI (e.g. rtsp://) */
+std::string file_pipeline (struct flb_csi_camera *ctx) {
+    std::string src(ctx->location);
+
+    if (src.find("://") != std::string::npos) {
+        src = "uridecodebin uri=" + src;
+    }
+    else {
+        src = "filesrc location=" + src + " ! decodebin";
+    }
+
+    return src + " ! " + appsink_pipeline(ctx);
+}
+
+std::string test_pipeline (struct flb_csi_camera *ctx) {
+    return "videotestsrc is-live=true pattern=" + std::string(ctx->test_pattern) + " ! video/x-raw, width=(int)" +
+           std::to_string(ctx->capture_width) + ", height=(int)" + std::to_string(ctx->capture_height) +
+           ", framerate=(fraction)" + std::to_string(ctx->framerate) +
+           "/1 ! " + output_pipeline(ctx);
+}
+
+std::string source_pipeline(struct flb_csi_camera *ctx)
 {
-    std::string pipeline = gstreamer_pipeline(ctx->sensor_id,
-                                              ctx->capture_width,
-                                              ctx->capture_height,
-                                              ctx->capture_width,
-                                              ctx->capture_height,
-                                              ctx->framerate,
-                                              ctx->flip_method);
+    switch (ctx->source) {
+    case SOURCE_V4L2:
+        return v4l2_pipeline(ctx);
+    case SOURCE_FILE:
+        return file_pipeline(ctx);
+    case SOURCE_TESTSRC:
+        return test_pipeline(ctx);
+    case SOURCE_PIPELINE:
+        return std::string(ctx->pipeline);
+    default:
+        return gstreamer_pipeline(ctx);
+    }
+}
+
+static bool is_directory(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int open_video_stream(struct video_capture *vc)
+{
+    cv::VideoCapture &capture = vc->capture;
 
     /* https://docs.opencv.org/3.4/d8/dfe/classcv_1_1VideoCapture.html#a57c0e81e83e60f36c83027dc2a188e80 */
-    capture = cv::VideoCapture(pipeline, cv::CAP_GSTREAMER);
+    capture.open(vc->pipeline, cv::CAP_GSTREAMER);
 
     /*
      *  Note: 3+ second delay in frames is happening. It was even more until the followings are set
@@ -75,49 +217,548 @@ int create_video_stream(struct flb_csi_camera *ctx)
      capture.set(cv::CAP_PROP_BUFFERSIZE, 1);
 
     if(!capture.isOpened()) {
-        std::cout << "Failed to open CSI camera!" << std::endl;
+        std::cout << "Failed to open capture pipeline: " << vc->pipeline << std::endl;
         return -1;
     }
 
     return 0;
 }
 
-int capture_video_frame(struct flb_csi_camera *ctx)
+int create_video_stream(struct flb_csi_camera *ctx)
 {
-    /* capture the next frame only when the previous one is processed */
-    if (!ctx->rw_handle.frame_processed) {
-      return -1;
+    ctx->capture = new video_capture();
+
+    /*
+     * custom pipelines and image directories deliver BGR frames of the
+     * capture size, everything else is left to the GStreamer pipeline
+     */
+    if (ctx->source == SOURCE_PIPELINE ||
+        (ctx->source == SOURCE_FILE && is_directory(ctx->location))) {
+        ctx->capture->cpu_crop_scale = ctx->crop_width != ctx->capture_width ||
+                                       ctx->crop_height != ctx->capture_height ||
+                                       ctx->output_width != ctx->crop_width ||
+                                       ctx->output_height != ctx->crop_height;
+        ctx->capture->cpu_convert = ctx->pixel_format != PIXEL_FORMAT_BGR;
+    }
+    else {
+        ctx->capture->cpu_crop_scale = false;
+        ctx->capture->cpu_convert = ctx->pixel_format == PIXEL_FORMAT_RGB ||
+                                    ctx->pixel_format == PIXEL_FORMAT_NV12;
+    }
+
+    if (ctx->encoding == ENCODING_JPEG) {
+        ctx->capture->raw.create(ctx->output_height, ctx->output_width,
+                                 ctx->pixel_format == PIXEL_FORMAT_GRAY ? CV_8UC1 : CV_8UC3);
+        ctx->capture->encoded.reserve(ctx->frame_size);
+        ctx->capture->encode_params = {cv::IMWRITE_JPEG_QUALITY, ctx->jpeg_quality};
     }
 
-    /* capture the latest frame. Don't overlap with plugin's frame processing */
-    pthread_mutex_lock(&ctx->rw_handle.f_mutex);
+    ctx->capture->luma.create(MOTION_LUMA_HEIGHT, MOTION_LUMA_WIDTH, CV_8UC1);
+    ctx->capture->prev_luma.create(MOTION_LUMA_HEIGHT, MOTION_LUMA_WIDTH, CV_8UC1);
+    ctx->capture->has_prev_luma = false;
+
+    ctx->capture->live = ctx->source == SOURCE_CSI || ctx->source == SOURCE_V4L2 ||
+                         ctx->source == SOURCE_TESTSRC;
+    ctx->capture->has_time_offset = false;
+    ctx->capture->last_pos_ms = 0;
+    ctx->capture->frame_count = 0;
+
+    if (ctx->source == SOURCE_FILE && is_directory(ctx->location)) {
+        cv::glob(std::string(ctx->location) + "/*", ctx->capture->images);
+        if (ctx->capture->images.empty()) {
+            std::cout << "No images found in " << ctx->location << std::endl;
+            release_video_capture_device(ctx);
+            return -1;
+        }
+
+        ctx->capture->next_image = 0;
+        clock_gettime(CLOCK_MONOTONIC, &ctx->capture->next_frame_time);
+        return 0;
+    }
+
+    ctx->capture->pipeline = source_pipeline(ctx);
+    if (open_video_stream(ctx->capture) != 0) {
+        release_video_capture_device(ctx);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* next image of the directory (looping), resized to the capture size */
+static bool read_image_frame(struct flb_csi_camera *ctx, cv::Mat &img)
+{
+    size_t i;
+    cv::Mat frame;
+    struct video_capture *vc = ctx->capture;
+    struct timespec *next = &vc->next_frame_time;
+
+    /* pace the frames at the frame rate */
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+    next->tv_nsec += 1000000000L / ctx->framerate;
+    if (next->tv_nsec >= 1000000000L) {
+        next->tv_sec += next->tv_nsec / 1000000000L;
+        next->tv_nsec %= 1000000000L;
+    }
+
+    /* skip the files that can't be decoded */
+    for (i = 0; i < vc->images.size() && frame.empty(); i++) {
+        frame = cv::imread(vc->images[vc->next_image]);
+        vc->next_image = (vc->next_image + 1) % vc->images.size();
+    }
+
+    if (frame.empty()) {
+        return false;
+    }
+
+    cv::resize(frame, img, cv::Size(ctx->capture_width, ctx->capture_height));
+    return true;
+}
+
+static bool read_video_frame(struct flb_csi_camera *ctx, cv::Mat &img)
+{
+    struct video_capture *vc = ctx->capture;
+
+    if (!vc->images.empty()) {
+        return read_image_frame(ctx, img);
+    }
 
     /*
-     * unlock the mutex in the case of error when reading a frame
-     * cv::VideoCapture::read is blocking (not an async function) and has to run
-     * in a separate thread.
+     * a pipeline that couldn't be reopened after a pause is retried, unless
+     * the plugin is exiting
      */
-    if (!capture.read(img)) {
-        pthread_mutex_unlock(&ctx->rw_handle.f_mutex);
-		    return -1;
-	  }
+    if (__atomic_load_n(&ctx->plugin_exit_called, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    if (!vc->capture.isOpened() && open_video_stream(vc) != 0) {
+        return false;
+    }
+
+    if (vc->capture.read(img)) {
+        return true;
+    }
+
+    /* video files loop: start over at the end of the stream */
+    if (ctx->source == SOURCE_FILE &&
+        !__atomic_load_n(&ctx->plugin_exit_called, __ATOMIC_ACQUIRE)) {
+        vc->capture.release();
+        if (open_video_stream(vc) == 0) {
+            return vc->capture.read(img);
+        }
+    }
 
-    /* frame_processed is unset when the frame is captured. Will be set by the
-     *  plugin after is is packed.
+    return false;
+}
+
+/* BGR frame to NV12: the I420 chroma planes are interleaved after the luma plane */
+static void convert_to_nv12(struct flb_csi_camera *ctx, const cv::Mat &src, char *slot)
+{
+    int i;
+    int luma_size = ctx->output_width * ctx->output_height;
+    int chroma_size = luma_size / 4;
+    struct video_capture *vc = ctx->capture;
+    const uchar *u;
+    const uchar *v;
+    uchar *uv;
+
+    cv::cvtColor(src, vc->i420, cv::COLOR_BGR2YUV_I420);
+
+    memcpy(slot, vc->i420.data, luma_size);
+    u = vc->i420.data + luma_size;
+    v = u + chroma_size;
+    uv = (uchar *) slot + luma_size;
+    for (i = 0; i < chroma_size; i++) {
+        uv[2 * i] = u[i];
+        uv[2 * i + 1] = v[i];
+    }
+}
+
+/* crop, scale and convert a captured BGR frame into the slot */
+static int process_video_frame(struct flb_csi_camera *ctx, char *slot)
+{
+    struct video_capture *vc = ctx->capture;
+    cv::Mat src = vc->frame;
+
+    if (vc->cpu_crop_scale) {
+        if (src.cols != ctx->capture_width || src.rows != ctx->capture_height) {
+            std::cout << "Captured frame size doesn't match the configured size!" << std::endl;
+            return -1;
+        }
+
+        src = src(cv::Rect(ctx->crop_x, ctx->crop_y, ctx->crop_width, ctx->crop_height));
+        if (ctx->output_width != ctx->crop_width || ctx->output_height != ctx->crop_height) {
+            cv::resize(src, vc->scaled, cv::Size(ctx->output_width, ctx->output_height),
+                       0, 0, cv::INTER_AREA);
+            src = vc->scaled;
+        }
+    }
+    else if (src.cols != ctx->output_width || src.rows != ctx->output_height) {
+        std::cout << "Captured frame size doesn't match the configured size!" << std::endl;
+        return -1;
+    }
+
+    switch (ctx->pixel_format) {
+    case PIXEL_FORMAT_RGB: {
+        cv::Mat out(ctx->output_height, ctx->output_width, CV_8UC3, slot);
+        cv::cvtColor(src, out, cv::COLOR_BGR2RGB);
+        break;
+    }
+    case PIXEL_FORMAT_GRAY: {
+        cv::Mat out(ctx->output_height, ctx->output_width, CV_8UC1, slot);
+        cv::cvtColor(src, out, cv::COLOR_BGR2GRAY);
+        break;
+    }
+    case PIXEL_FORMAT_NV12:
+        convert_to_nv12(ctx, src, slot);
+        break;
+    default: {
+        cv::Mat out(ctx->output_height, ctx->output_width, CV_8UC3, slot);
+        src.copyTo(out);
+    }
+    }
+
+    return 0;
+}
+
+/* read the next raw frame of the output size and pixel format into dst */
+static int read_raw_frame(struct flb_csi_camera *ctx, char *dst)
+{
+    struct video_capture *vc = ctx->capture;
+
+    if (vc->cpu_crop_scale || vc->cpu_convert) {
+        if (!read_video_frame(ctx, vc->frame)) {
+            return -1;
+        }
+        return process_video_frame(ctx, dst);
+    }
+
+    /*
+     * the Mat header wraps dst, and reading a frame of the same size and
+     * type doesn't reallocate it
      */
-    ctx->rw_handle.frame_processed = false;
+    cv::Mat img(ctx->output_height, ctx->output_width,
+                ctx->pixel_format == PIXEL_FORMAT_GRAY ? CV_8UC1 : CV_8UC3, dst);
 
-    pthread_mutex_unlock(&ctx->rw_handle.f_mutex);
+    if (!read_video_frame(ctx, img)) {
+        return -1;
+    }
+
+    /* the frame didn't fit and has been captured into a new buffer */
+    if (img.data != (uchar *) dst) {
+        if (img.total() * img.elemSize() != (size_t) ctx->frame_size) {
+            std::cout << "Captured frame size doesn't match the configured size!" << std::endl;
+            return -1;
+        }
+        memcpy(dst, img.data, ctx->frame_size);
+    }
 
     return 0;
 }
 
-const char *video_frame_ptr()
+/*
+ * encode the raw frame into the slot. The encode buffer keeps its capacity
+ * across frames, so it is only reallocated if a frame compresses worse
+ * than all of the previous ones.
+ */
+static int encode_jpeg_frame(struct flb_csi_camera *ctx, char *slot)
+{
+    struct video_capture *vc = ctx->capture;
+
+    if (!cv::imencode(".jpg", vc->raw, vc->encoded, vc->encode_params)) {
+        std::cout << "Failed to encode the captured frame!" << std::endl;
+        return -1;
+    }
+
+    /* slots hold a raw frame, which a jpeg frame is practically never larger than */
+    if (vc->encoded.size() > (size_t) ctx->frame_size) {
+        std::cout << "Encoded frame is larger than the raw frame, dropped" << std::endl;
+        return -1;
+    }
+
+    memcpy(slot, vc->encoded.data(), vc->encoded.size());
+    frame_buffer_write_info(&ctx->frames)->length = vc->encoded.size();
+
+    return 0;
+}
+
+/* downsampled luma plane of a raw frame, into vc->luma */
+static void motion_luma(struct flb_csi_camera *ctx, char *raw)
+{
+    struct video_capture *vc = ctx->capture;
+    cv::Size size(MOTION_LUMA_WIDTH, MOTION_LUMA_HEIGHT);
+
+    if (ctx->pixel_format == PIXEL_FORMAT_GRAY || ctx->pixel_format == PIXEL_FORMAT_NV12) {
+        /* NV12 starts with the full resolution luma plane */
+        cv::Mat y(ctx->output_height, ctx->output_width, CV_8UC1, raw);
+        cv::resize(y, vc->luma, size, 0, 0, cv::INTER_AREA);
+        return;
+    }
+
+    /* downsample first, the color conversion is then nearly free */
+    cv::Mat color(ctx->output_height, ctx->output_width, CV_8UC3, raw);
+    cv::resize(color, vc->motion_small, size, 0, 0, cv::INTER_AREA);
+    cv::cvtColor(vc->motion_small, vc->luma,
+                 ctx->pixel_format == PIXEL_FORMAT_RGB ? cv::COLOR_RGB2GRAY : cv::COLOR_BGR2GRAY);
+}
+
+/*
+ * score the motion since the previous frame, and decide if the frame is
+ * emitted: its score has to reach the threshold, at least
+ * motion_min_interval_ms after the last emitted frame. A keyframe is emitted
+ * anyway every keyframe_interval seconds, so that static scenes still show up.
+ */
+static bool motion_gate(struct flb_csi_camera *ctx, char *raw, float *score)
+{
+    int64_t now;
+    int64_t elapsed;
+    struct video_capture *vc = ctx->capture;
+
+    motion_luma(ctx, raw);
+
+    if (vc->has_prev_luma) {
+        *score = motion_score(vc->luma.data, vc->prev_luma.data,
+                              MOTION_LUMA_WIDTH * MOTION_LUMA_HEIGHT);
+    }
+    else {
+        *score = 0;
+    }
+    cv::swap(vc->luma, vc->prev_luma);
+
+    now = monotonic_ms();
+    elapsed = now - vc->last_emit_ms;
+
+    /* the first frame is a keyframe */
+    if (!vc->has_prev_luma ||
+        (ctx->keyframe_interval > 0 && elapsed >= (int64_t) ctx->keyframe_interval * 1000) ||
+        (*score >= ctx->motion_threshold && elapsed >= ctx->motion_min_interval_ms)) {
+        vc->has_prev_luma = true;
+        vc->last_emit_ms = now;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * capture time of the frame just read. Live sources use the timestamp of the
+ * buffer, and the gaps between timestamps tell how many frames the appsink
+ * dropped; other sources use the time the frame was read at.
+ */
+static void capture_timestamp(struct flb_csi_camera *ctx, struct timespec *ts)
 {
-    return (const char *) img.ptr<char>(0, 0, 0);
+    double pos;
+    double now;
+    double gap;
+    double time_ms;
+    struct video_capture *vc = ctx->capture;
+
+    clock_gettime(CLOCK_REALTIME, ts);
+
+    if (!vc->live) {
+        return;
+    }
+
+    pos = vc->capture.get(cv::CAP_PROP_POS_MSEC);
+    if (pos <= 0) {
+        return;
+    }
+
+    /* frames are read late, never early: the smallest offset is the closest one */
+    now = ts->tv_sec * 1000.0 + ts->tv_nsec / 1e6;
+    if (!vc->has_time_offset || now - pos < vc->time_offset_ms) {
+        vc->time_offset_ms = now - pos;
+        vc->has_time_offset = true;
+    }
+
+    if (vc->last_pos_ms > 0) {
+        gap = (pos - vc->last_pos_ms) * ctx->framerate / 1000.0;
+        if (gap >= 1.5) {
+            __atomic_add_fetch(&ctx->frames_dropped, (uint64_t) std::llround(gap) - 1,
+                               __ATOMIC_RELAXED);
+        }
+    }
+    vc->last_pos_ms = pos;
+
+    time_ms = vc->time_offset_ms + pos;
+    ts->tv_sec = (time_t) (time_ms / 1000);
+    ts->tv_nsec = (long) ((time_ms - ts->tv_sec * 1000.0) * 1000000);
+}
+
+/* read past the next frame, without retrieving (decoding and copying) it */
+static bool skip_video_frame(struct flb_csi_camera *ctx)
+{
+    struct video_capture *vc = ctx->capture;
+
+    if (!vc->images.empty() || ctx->source == SOURCE_FILE) {
+        return read_video_frame(ctx, vc->frame);
+    }
+
+    if (!vc->capture.grab()) {
+        return false;
+    }
+
+    /* skipped frames are not dropped frames */
+    if (vc->live) {
+        vc->last_pos_ms = vc->capture.get(cv::CAP_PROP_POS_MSEC);
+    }
+
+    return true;
 }
 
-void release_video_capture_device()
+/* a partial burst is published once its first frame is max_batch_latency_ms old */
+static bool burst_expired(struct flb_csi_camera *ctx, struct frame_info *info)
 {
-    capture.release();
+    struct timespec now;
+
+    if (ctx->max_batch_latency_ms <= 0 || info->frames == 0) {
+        return false;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - info->time.tv_sec) * 1000 +
+           (now.tv_nsec - info->time.tv_nsec) / 1000000 >= ctx->max_batch_latency_ms;
+}
+
+static int publish_frames(struct flb_csi_camera *ctx)
+{
+    struct frame_info *info;
+
+    if (ctx->frame_transport == TRANSPORT_SHM) {
+        info = frame_buffer_write_info(&ctx->frames);
+        frame_ring_end_write(&ctx->ring, info->ring_slot, info->seq);
+        ctx->ring_next = (ctx->ring_next + 1) % ctx->shm_slots;
+    }
+
+    /* after publishing, the write slot is the one that has been overwritten, if any */
+    if (frame_buffer_publish(&ctx->frames)) {
+        info = frame_buffer_write_info(&ctx->frames);
+        __atomic_add_fetch(&ctx->frames_overwritten, info->frames, __ATOMIC_RELAXED);
+    }
+    frame_buffer_write_info(&ctx->frames)->frames = 0;
+
+    return 0;
+}
+
+/*
+ * capture the next frame into the write slot, and publish the slot once it
+ * holds frames_per_record frames. Returns 0 if a record has been published,
+ * 1 if not (frame gated, or burst incomplete) and -1 on errors.
+ */
+int capture_video_frame(struct flb_csi_camera *ctx)
+{
+    int stride;
+    uint64_t seq;
+    float score = 0;
+    char *raw;
+    char *frame;
+    struct timespec ts;
+    struct frame_info *info;
+    struct video_capture *vc = ctx->capture;
+
+    /*
+     * capture straight into the free record of the frame buffer (after the
+     * frames of the burst captured so far), or into the raw frame buffer if
+     * the frame is encoded (on this thread, so that the event loop never pays
+     * for it).
+     * cv::VideoCapture::read is blocking (not an async function) and has to run
+     * in a separate thread.
+     */
+    /* frames left out by the adaptive frame rate are not even retrieved */
+    stride = __atomic_load_n(&ctx->frame_stride, __ATOMIC_RELAXED);
+    if (stride > 1 && vc->frame_count++ % stride != 0) {
+        return skip_video_frame(ctx) ? 1 : -1;
+    }
+
+    info = frame_buffer_write_info(&ctx->frames);
+    if (ctx->frame_transport == TRANSPORT_SHM) {
+        /* a reader holding a reference to the previous frame of the ring slot sees it's gone */
+        if (info->frames == 0) {
+            info->ring_slot = ctx->ring_next;
+            frame_ring_begin_write(&ctx->ring, info->ring_slot);
+        }
+        frame = frame_ring_data(&ctx->ring, info->ring_slot) +
+                (size_t) info->frames * ctx->frame_size;
+    }
+    else {
+        frame = frame_buffer_write_slot(&ctx->frames) + ctx->record_header_size +
+                (size_t) info->frames * ctx->frame_size;
+    }
+    raw = ctx->encoding == ENCODING_JPEG ? (char *) vc->raw.data : frame;
+
+    if (read_raw_frame(ctx, raw) != 0) {
+        return -1;
+    }
+
+    capture_timestamp(ctx, &ts);
+    seq = __atomic_add_fetch(&ctx->frames_captured, 1, __ATOMIC_RELAXED);
+
+    /* frames without motion are dropped before they are encoded */
+    if (ctx->motion_threshold > 0 && !motion_gate(ctx, raw, &score)) {
+        return burst_expired(ctx, info) ? publish_frames(ctx) : 1;
+    }
+
+    /* a record is stamped with its first frame */
+    if (info->frames == 0) {
+        info->time = ts;
+        info->seq = seq;
+        info->motion = score;
+    }
+    else if (score > info->motion) {
+        info->motion = score;
+    }
+
+    if (ctx->encoding == ENCODING_JPEG) {
+        if (encode_jpeg_frame(ctx, frame) != 0) {
+            return -1;
+        }
+    }
+    else {
+        info->length = (info->frames + 1) * ctx->frame_size;
+    }
+    info->frames++;
+
+    if (info->frames < ctx->frames_per_record && !burst_expired(ctx, info)) {
+        return 1;
+    }
+
+    return publish_frames(ctx);
+}
+
+/* release the capture pipeline while the instance is paused */
+void pause_video_stream(struct flb_csi_camera *ctx)
+{
+    if (ctx->capture->images.empty()) {
+        ctx->capture->capture.release();
+    }
+}
+
+int resume_video_stream(struct flb_csi_camera *ctx)
+{
+    struct video_capture *vc = ctx->capture;
+
+    /*
+     * restart the frame pacing and the buffer timestamps: frames missed while
+     * paused are not dropped frames, and a reopened pipeline starts its
+     * running time over
+     */
+    clock_gettime(CLOCK_MONOTONIC, &vc->next_frame_time);
+    vc->has_time_offset = false;
+    vc->last_pos_ms = 0;
+
+    if (!vc->images.empty() || vc->capture.isOpened()) {
+        return 0;
+    }
+
+    return open_video_stream(vc);
+}
+
+void release_video_capture_device(struct flb_csi_camera *ctx)
+{
+    if (!ctx->capture) {
+        return;
+    }
+
+    ctx->capture->capture.release();
+    delete ctx->capture;
+    ctx->capture = NULL;
 }
@@ -27,8 +27,11 @@ EXTERNC int create_video_stream(struct flb_csi_camera *);
 //EXTERNC const char *get_next_frame();
 
 EXTERNC int capture_video_frame(struct flb_csi_camera *);
-EXTERNC const char *video_frame_ptr();
 
-EXTERNC void release_video_capture_device();
+EXTERNC void pause_video_stream(struct flb_csi_camera *);
+
+EXTERNC int resume_video_stream(struct flb_csi_camera *);
+
+EXTERNC void release_video_capture_device(struct flb_csi_camera *);
 
 #undef EXTERNC